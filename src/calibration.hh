@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "support.hh"
+
+/*
+  Startup calibration of a workload's size parameter (loop count, pages chased, repetitions...).
+  The workload's user-space instructions per iteration are counted at a few probe sizes, a line
+  (instructions = fixed + per_unit * size) is fitted through them by least squares, and the size
+  that comes closest to the requested instruction count is solved for and measured again.
+  This keeps workloads at equal granularity regardless of the compiler and CPU.
+*/
+struct WorkloadCalibration
+{
+  size_t size;
+  double fixed_instructions;
+  double instructions_per_unit;
+  double instructions_per_iteration; // measured at the chosen size
+};
+
+// make_workload( size ) returns a workload of that size, and run_iteration( workload ) runs one iteration of it
+template<class MakeWorkload, class RunIteration>
+WorkloadCalibration calibrate_workload_size( uint64_t target_instructions,
+                                             std::initializer_list<size_t> probe_sizes,
+                                             const MakeWorkload& make_workload,
+                                             const RunIteration& run_iteration )
+{
+  constexpr size_t iterations_per_probe = 1000;
+
+  IPCCounter counter;
+  counter.start();
+
+  const auto instructions_per_iteration = [&]( size_t size ) {
+    auto workload = make_workload( size );
+    run_iteration( workload ); // warm up
+
+    const auto beginning = counter.read();
+    for ( size_t i = 0; i < iterations_per_probe; ++i ) {
+      run_iteration( workload );
+    }
+    const auto ending = counter.read();
+    return double( ending.instructions - beginning.instructions ) / double( iterations_per_probe );
+  };
+
+  std::vector<std::pair<double, double>> points;
+  for ( const auto size : probe_sizes ) {
+    points.emplace_back( double( size ), instructions_per_iteration( size ) );
+  }
+
+  // least-squares fit
+  double mean_size = 0, mean_instructions = 0;
+  for ( const auto& [size, instructions] : points ) {
+    mean_size += size / double( points.size() );
+    mean_instructions += instructions / double( points.size() );
+  }
+  double covariance = 0, variance = 0;
+  for ( const auto& [size, instructions] : points ) {
+    covariance += ( size - mean_size ) * ( instructions - mean_instructions );
+    variance += ( size - mean_size ) * ( size - mean_size );
+  }
+  if ( variance == 0 || covariance <= 0 ) {
+    throw std::runtime_error( "calibration: instruction count does not grow with workload size" );
+  }
+
+  WorkloadCalibration ret {};
+  ret.instructions_per_unit = covariance / variance;
+  ret.fixed_instructions = mean_instructions - ret.instructions_per_unit * mean_size;
+  const double size = ( double( target_instructions ) - ret.fixed_instructions ) / ret.instructions_per_unit;
+  ret.size = size_t( std::max( 1.0, std::round( size ) ) );
+  ret.instructions_per_iteration = instructions_per_iteration( ret.size );
+
+  counter.stop();
+  return ret;
+}
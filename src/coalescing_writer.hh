@@ -0,0 +1,173 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "support.hh"
+
+/*
+  Accumulates small writes in a user-space buffer and hands them to the kernel with a single
+  pwritev (one iovec per write) once a byte, write-count or TSC-deadline threshold is reached.
+
+  With the adaptive policy, the caller reports how long each unit of its own work took
+  (note_work), and the writer compares the work done just after a flush with the work done
+  at other times. That difference is the flush's indirect cost (lost IPC from cache and
+  predictor pollution); together with the flush's direct cost it is amortized over the writes
+  in the batch. The write-count threshold doubles while that overhead exceeds the target
+  fraction of the work, and halves (to cut latency) while it is well below.
+*/
+class CoalescingWriter
+{
+public:
+  struct Policy
+  {
+    size_t max_bytes;       // flush when this many bytes are pending
+    size_t max_writes;      // flush when this many writes are pending (the adaptive threshold)
+    uint64_t max_delay_tsc; // flush when the oldest pending write is this many TSC ticks old
+    bool adaptive;
+    double target_overhead; // adaptive: acceptable flush cost, as a fraction of the work it interrupts
+  };
+
+private:
+  int fd_;
+  off_t file_offset_;
+  Policy policy_;
+
+  std::vector<char> buffer_ {};
+  std::vector<size_t> write_sizes_ {};
+  std::vector<iovec> iovecs_ {};
+  uint64_t oldest_pending_tsc_ {};
+
+  // statistics
+  uint64_t flush_count_ {};
+  uint64_t write_count_ {};
+  uint64_t total_latency_tsc_ {}; // sum over writes of (flush time - write time)
+  uint64_t max_latency_tsc_ {};
+  std::vector<uint64_t> pending_tsc_ {};
+
+  // adaptive policy state (exponentially weighted moving averages, in TSC ticks)
+  bool just_flushed_ { false };
+  double flush_cost_ {}, work_after_flush_ {}, work_otherwise_ {};
+
+  static void update_average( double& average, double sample )
+  {
+    average = average == 0 ? sample : 0.9 * average + 0.1 * sample;
+  }
+
+  void adapt( size_t batch_size )
+  {
+    if ( work_otherwise_ == 0 || work_after_flush_ == 0 ) {
+      return;
+    }
+
+    const double indirect_cost = std::max( 0.0, work_after_flush_ - work_otherwise_ );
+    const double overhead_per_write = ( flush_cost_ + indirect_cost ) / double( batch_size );
+    const double overhead = overhead_per_write / work_otherwise_;
+
+    if ( overhead > policy_.target_overhead ) {
+      policy_.max_writes = std::min<size_t>( policy_.max_writes * 2, IOV_MAX );
+    } else if ( overhead < policy_.target_overhead / 4 ) {
+      policy_.max_writes = std::max<size_t>( policy_.max_writes / 2, 1 );
+    }
+  }
+
+public:
+  CoalescingWriter( int fd, off_t file_offset, const Policy& policy )
+    : fd_( fd ), file_offset_( file_offset ), policy_( policy )
+  {
+    policy_.max_writes = std::clamp<size_t>( policy_.max_writes, 1, IOV_MAX );
+    buffer_.reserve( policy_.max_bytes );
+  }
+
+  void write( std::span<const char> data )
+  {
+    const uint64_t now = __rdtsc();
+    if ( write_sizes_.empty() ) {
+      oldest_pending_tsc_ = now;
+    }
+
+    buffer_.insert( buffer_.end(), data.begin(), data.end() );
+    write_sizes_.push_back( data.size() );
+    pending_tsc_.push_back( now );
+
+    if ( buffer_.size() >= policy_.max_bytes || write_sizes_.size() >= policy_.max_writes
+         || now - oldest_pending_tsc_ >= policy_.max_delay_tsc ) {
+      flush();
+    }
+  }
+
+  // report the duration of one unit of the caller's work (used by the adaptive policy)
+  void note_work( uint64_t tsc_ticks )
+  {
+    update_average( just_flushed_ ? work_after_flush_ : work_otherwise_, double( tsc_ticks ) );
+    just_flushed_ = false;
+  }
+
+  void flush()
+  {
+    if ( write_sizes_.empty() ) {
+      return;
+    }
+
+    const uint64_t beginning = __rdtsc();
+
+    iovecs_.clear();
+    size_t offset = 0;
+    for ( const auto size : write_sizes_ ) {
+      iovecs_.push_back( { buffer_.data() + offset, size } );
+      offset += size;
+    }
+
+    const auto written = CheckSystemCall( "pwritev", pwritev( fd_, iovecs_.data(), iovecs_.size(), file_offset_ ) );
+    if ( size_t( written ) != buffer_.size() ) {
+      throw std::runtime_error( "short write" );
+    }
+    file_offset_ += written;
+
+    const uint64_t ending = __rdtsc();
+    for ( const auto pending_tsc : pending_tsc_ ) {
+      total_latency_tsc_ += ending - pending_tsc;
+      max_latency_tsc_ = std::max( max_latency_tsc_, ending - pending_tsc );
+    }
+    const size_t batch_size = write_sizes_.size();
+    write_count_ += batch_size;
+    ++flush_count_;
+
+    buffer_.clear();
+    write_sizes_.clear();
+    pending_tsc_.clear();
+
+    if ( policy_.adaptive ) {
+      update_average( flush_cost_, double( ending - beginning ) );
+      adapt( batch_size );
+    }
+    just_flushed_ = true;
+  }
+
+  ~CoalescingWriter()
+  {
+    try {
+      flush();
+    } catch ( const std::exception& ) {
+      // nowhere to report it from a destructor
+    }
+  }
+
+  CoalescingWriter( const CoalescingWriter& ) = delete;
+  CoalescingWriter& operator=( const CoalescingWriter& ) = delete;
+
+  uint64_t flush_count() const { return flush_count_; }
+  uint64_t write_count() const { return write_count_; }
+  size_t max_writes() const { return policy_.max_writes; }
+  uint64_t max_latency_tsc() const { return max_latency_tsc_; }
+  double average_latency_tsc() const
+  {
+    return write_count_ ? double( total_latency_tsc_ ) / double( write_count_ ) : 0;
+  }
+};
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "support.hh"
+
+using namespace std;
+
+using Record = map<string, string, less<>>;
+
+// Regularized incomplete beta function I_x(a, b), by continued fraction (modified Lentz's method)
+double incomplete_beta( double a, double b, double x )
+{
+  if ( x <= 0 ) {
+    return 0;
+  }
+  if ( x >= 1 ) {
+    return 1;
+  }
+
+  // the continued fraction converges quickly only for x < (a + 1) / (a + b + 2)
+  if ( x > ( a + 1 ) / ( a + b + 2 ) ) {
+    return 1 - incomplete_beta( b, a, 1 - x );
+  }
+
+  constexpr double tiny = 1e-300;
+  const double front = exp( lgamma( a + b ) - lgamma( a ) - lgamma( b ) + a * log( x ) + b * log( 1 - x ) ) / a;
+
+  double f = 1, c = 1, d = 0;
+  for ( int i = 0; i <= 400; ++i ) {
+    const int m = i / 2;
+    double numerator;
+    if ( i == 0 ) {
+      numerator = 1;
+    } else if ( i % 2 == 0 ) {
+      numerator = ( m * ( b - m ) * x ) / ( ( a + 2 * m - 1 ) * ( a + 2 * m ) );
+    } else {
+      numerator = -( ( a + m ) * ( a + b + m ) * x ) / ( ( a + 2 * m ) * ( a + 2 * m + 1 ) );
+    }
+
+    d = 1 + numerator * d;
+    d = 1 / ( abs( d ) < tiny ? tiny : d );
+    c = 1 + numerator / c;
+    c = abs( c ) < tiny ? tiny : c;
+    f *= c * d;
+
+    if ( abs( 1 - c * d ) < 1e-12 ) {
+      return front * ( f - 1 );
+    }
+  }
+
+  throw runtime_error( "incomplete beta function did not converge" );
+}
+
+struct Summary
+{
+  size_t count;
+  double mean, variance;
+};
+
+Summary summarize( const vector<double>& values )
+{
+  Summary ret { values.size(), 0, 0 };
+  for ( const auto value : values ) {
+    ret.mean += value;
+  }
+  ret.mean /= double( values.size() );
+  for ( const auto value : values ) {
+    ret.variance += ( value - ret.mean ) * ( value - ret.mean );
+  }
+  ret.variance /= double( values.size() - 1 );
+  return ret;
+}
+
+// Two-sided p-value of Welch's t-test for a difference in means
+double welch_p_value( const Summary& x, const Summary& y )
+{
+  const double x_term = x.variance / double( x.count ), y_term = y.variance / double( y.count );
+  const double squared_error = x_term + y_term;
+  if ( squared_error == 0 ) {
+    return x.mean == y.mean ? 1 : 0;
+  }
+
+  const double t = ( y.mean - x.mean ) / sqrt( squared_error );
+  const double dof = squared_error * squared_error
+                     / ( x_term * x_term / double( x.count - 1 ) + y_term * y_term / double( y.count - 1 ) );
+  return incomplete_beta( dof / 2, 0.5, dof / ( dof + t * t ) );
+}
+
+vector<Record> read_results( const string& filename, string_view selector )
+{
+  ifstream file { filename };
+  if ( !file ) {
+    throw runtime_error( "could not open " + filename );
+  }
+
+  string selector_key, selector_value;
+  if ( selector != "all"sv ) {
+    const auto equals = selector.find( '=' );
+    if ( equals == string_view::npos ) {
+      throw runtime_error( "selector must be \"all\" or key=value: " + string( selector ) );
+    }
+    selector_key = selector.substr( 0, equals );
+    selector_value = selector.substr( equals + 1 );
+  }
+
+  vector<Record> ret;
+  string line;
+  while ( getline( file, line ) ) {
+    Record record;
+    string_view rest = line;
+    while ( !rest.empty() ) {
+      const auto field = rest.substr( 0, rest.find( '\t' ) );
+      rest.remove_prefix( min( rest.size(), field.size() + 1 ) );
+      const auto equals = field.find( '=' );
+      if ( equals != string_view::npos ) {
+        record.emplace( field.substr( 0, equals ), field.substr( equals + 1 ) );
+      }
+    }
+
+    if ( !record.contains( "experiment" ) ) {
+      continue;
+    }
+    if ( !selector_key.empty() ) {
+      const auto it = record.find( selector_key );
+      if ( it == record.end() || it->second != selector_value ) {
+        continue;
+      }
+    }
+    ret.push_back( move( record ) );
+  }
+
+  return ret;
+}
+
+// The experiment and its configuration identify which records are comparable
+string configuration_of( const Record& record )
+{
+  string ret = record.at( "experiment" );
+  for ( const auto& [key, value] : record ) {
+    if ( key.starts_with( "config." ) ) {
+      ret += " " + key.substr( strlen( "config." ) ) + "=" + value;
+    }
+  }
+  return ret;
+}
+
+// configuration -> metric -> values
+using MetricTable = map<string, map<string, vector<double>>>;
+
+MetricTable tabulate( const vector<Record>& records )
+{
+  MetricTable ret;
+  for ( const auto& record : records ) {
+    auto& metrics = ret[configuration_of( record )];
+    for ( const auto& [key, value] : record ) {
+      if ( key.starts_with( "max." ) || key.starts_with( "min." ) ) {
+        metrics[key].push_back( stod( value ) );
+      }
+    }
+  }
+  return ret;
+}
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0]
+       << " baseline_results baseline_selector candidate_results candidate_selector [significance_level]\n"
+          "  (a selector is \"all\" or key=value, e.g. host.kernel_release=6.1.0-13-amd64)\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() != 5 && args.size() != 6 ) {
+    usage_error( args );
+  }
+  const double significance_level = args.size() == 6 ? stod( args[5] ) : 0.01;
+
+  const auto baseline = tabulate( read_results( args[1], args[2] ) );
+  const auto candidate = tabulate( read_results( args[3], args[4] ) );
+
+  // Compare every metric present on both sides with at least two runs each
+  unsigned int regressions = 0, compared = 0;
+  cout << "# configuration metric baseline_mean baseline_stddev baseline_runs candidate_mean candidate_stddev"
+          " candidate_runs change_percent p_value verdict\n";
+  for ( const auto& [configuration, baseline_metrics] : baseline ) {
+    const auto candidate_it = candidate.find( configuration );
+    if ( candidate_it == candidate.end() ) {
+      continue;
+    }
+
+    for ( const auto& [metric, baseline_values] : baseline_metrics ) {
+      const auto values_it = candidate_it->second.find( metric );
+      if ( values_it == candidate_it->second.end() ) {
+        continue;
+      }
+      const auto& candidate_values = values_it->second;
+
+      cout << configuration << "\t" << metric << "\t";
+      if ( baseline_values.size() < 2 || candidate_values.size() < 2 ) {
+        cout << "(need at least two runs on each side)\n";
+        continue;
+      }
+
+      const auto x = summarize( baseline_values ), y = summarize( candidate_values );
+      ++compared;
+      const double p_value = welch_p_value( x, y );
+      const bool higher_is_better = metric.starts_with( "max." );
+      const bool worse = higher_is_better ? y.mean < x.mean : y.mean > x.mean;
+
+      const char* verdict = "";
+      if ( p_value < significance_level ) {
+        verdict = worse ? "REGRESSION" : "improvement";
+        regressions += worse;
+      }
+
+      cout << x.mean << " " << sqrt( x.variance ) << " " << x.count << " ";
+      cout << y.mean << " " << sqrt( y.variance ) << " " << y.count << " ";
+      cout << 100.0 * ( y.mean - x.mean ) / x.mean << " " << p_value << " " << verdict << "\n";
+    }
+  }
+
+  // Comparing nothing is not a pass: the selectors matched no records, or the two sides share
+  // no configuration with enough runs
+  if ( compared == 0 ) {
+    cerr << "ERROR: no metrics were compared (check the selectors, and that both sides ran the same"
+            " configurations at least twice)\n";
+    return EXIT_FAILURE;
+  }
+
+  cerr << "Metrics compared: " << compared << "\n";
+  cerr << "Significant regressions (p < " << significance_level << "): " << regressions << "\n";
+
+  return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -8,12 +8,15 @@
 #include <span>
 #include <vector>
 
+#include "perf_event.hh"
+#include "results.hh"
 #include "support.hh"
 
 using namespace std;
 
 constexpr size_t total_iterations = 100000;
 constexpr size_t system_call_at = total_iterations / 2;
+constexpr int home_cpu = 0;
 
 constexpr size_t num_random_vectors = 32;
 constexpr size_t random_vector_size = 16;
@@ -60,6 +63,18 @@ public:
   void do_matrix_computation() { matrices[0] = matrices[1] * matrices[2]; }
 };
 
+// What happens at iteration system_call_at
+struct Disruption
+{
+  enum class Kind
+  {
+    None,     // copy one byte in user space
+    Syscall,  // 1-byte pwrite
+    Migration // sched_setaffinity to target_cpu (home_cpu itself for the same-CPU baseline)
+  } kind;
+  int target_cpu;
+};
+
 void trivial_memory_copy()
 {
   volatile char x = 42;
@@ -70,21 +85,60 @@ void trivial_memory_copy()
 
 void usage_error( const span<char*>& args )
 {
-  cerr << "Usage: " << args[0] << " \"syscall\"/\"nosyscall\" \"branchy\"/\"matrix\"\n";
+  cerr << "Usage: " << args[0]
+       << " disruption [=\"syscall\" or \"nosyscall\" or \"migrate_same\" or \"migrate_smt\" or \"migrate_llc\""
+          " or \"migrate_cross_llc\" or \"migrate_numa\"] \"branchy\"/\"matrix\" [sample_period]\n";
   throw runtime_error( "invalid usage" );
 }
 
-tuple<bool, bool> process_arguments( const auto& args )
+// Find a CPU to migrate to from home_cpu, at the given distance in the topology
+int find_migration_target( string_view distance )
 {
-  if ( args.size() != 3 ) {
+  if ( distance == "same"sv ) {
+    return home_cpu;
+  }
+
+  const auto smt_siblings = SMT_siblings( home_cpu );
+  const auto llc_siblings = LLC_siblings( home_cpu );
+  const auto contains = []( const vector<int>& cpus, int cpu ) { return ranges::find( cpus, cpu ) != cpus.end(); };
+
+  for ( const int cpu : online_CPUs() ) {
+    if ( cpu == home_cpu ) {
+      continue;
+    }
+    const bool same_core = contains( smt_siblings, cpu );
+    const bool same_llc = contains( llc_siblings, cpu );
+    const bool same_node = NUMA_node( cpu ) == NUMA_node( home_cpu );
+
+    if ( ( distance == "smt"sv && same_core ) || ( distance == "llc"sv && same_llc && !same_core )
+         || ( distance == "cross_llc"sv && !same_llc && same_node ) || ( distance == "numa"sv && !same_node ) ) {
+      return cpu;
+    }
+  }
+
+  throw runtime_error( "no CPU for migrate_" + string( distance ) + " on this machine" );
+}
+
+tuple<Disruption, bool, uint64_t> process_arguments( const auto& args )
+{
+  if ( args.size() != 3 && args.size() != 4 ) {
     usage_error( args );
   }
 
-  bool do_syscall;
-  if ( args[1] == "syscall"sv ) {
-    do_syscall = true;
-  } else if ( args[1] == "nosyscall"sv ) {
-    do_syscall = false;
+  Disruption disruption { Disruption::Kind::None, home_cpu };
+  const string_view disruption_name = args[1];
+  if ( disruption_name == "syscall"sv ) {
+    disruption.kind = Disruption::Kind::Syscall;
+  } else if ( disruption_name == "nosyscall"sv ) {
+    disruption.kind = Disruption::Kind::None;
+  } else if ( disruption_name.starts_with( "migrate_"sv ) ) {
+    const auto distance = disruption_name.substr( "migrate_"sv.size() );
+    if ( distance != "same"sv && distance != "smt"sv && distance != "llc"sv && distance != "cross_llc"sv
+         && distance != "numa"sv ) {
+      usage_error( args );
+    }
+    disruption.kind = Disruption::Kind::Migration;
+    disruption.target_cpu = find_migration_target( distance );
   } else {
     usage_error( args );
   }
@@ -98,32 +152,80 @@ tuple<bool, bool> process_arguments( const auto& args )
     usage_error( args );
   }
 
-  return tie( do_syscall, branchy );
+  // with a sample period, sample the counters every sample_period instructions instead of every iteration
+  uint64_t sample_period = 0;
+  if ( args.size() == 4 ) {
+    sample_period = to_uint64( args[3] );
+    if ( sample_period == 0 ) {
+      usage_error( args );
+    }
+  }
+
+  return { disruption, branchy, sample_period };
 }
 
-int main( int argc, char* argv[] )
+void do_iteration( unsigned int i, Workload& workload, int fd, const Disruption& disruption, bool branchy )
 {
-  ios::sync_with_stdio( false );
-
-  // Parse arguments
-  if ( argc <= 0 ) {
-    abort();
+  if ( i == system_call_at ) {
+    if ( disruption.kind == Disruption::Kind::Syscall ) { // do 1-byte pwrite system call in this iteration
+      if ( 1 != CheckSystemCall( "pwrite", pwrite( fd, "x", 1, 0 ) ) ) {
+        throw runtime_error( "short write" );
+      }
+    } else if ( disruption.kind == Disruption::Kind::Migration ) { // move to the target CPU (returns once there)
+      lock_to_CPU( disruption.target_cpu );
+    } else { // copy one byte in user space (without a syscall)
+      trivial_memory_copy();
+    }
+  } else { // otherwise, do some computation
+    if ( branchy ) {
+      workload.do_branchy_computation( i );
+    } else {
+      workload.do_matrix_computation();
+    }
   }
-  auto args = span( argv, argc );
-  auto [do_syscall, branchy] = process_arguments( args );
+}
 
-  // Open dummy file
-  int fd = memfd_create( "dummy", 0 );
-  if ( fd < 0 ) {
-    throw runtime_error( "memfd_create" );
-  }
+// print one interval of counter data, relative to the counts immediately after the syscall
+void print_interval( const SamplePair& sample, long long index_inst, long long index_cycle )
+{
+  const auto relative_instruction_beginning = sample.pre.instructions - index_inst;
+  const auto relative_instruction_ending = sample.post.instructions - index_inst;
 
-  // Prevent CPU migration
-  lock_to_CPU_zero();
+  const auto relative_cycle_beginning = sample.pre.cycles - index_cycle;
+  const auto relative_cycle_ending = sample.post.cycles - index_cycle;
 
-  // Initialize compute "workload"
-  Workload workload;
+  const auto instructions = sample.post.instructions - sample.pre.instructions;
+  const auto cycles = sample.post.cycles - sample.pre.cycles;
+  const double ipc = double( instructions ) / double( cycles );
+
+  const auto inst_box_middle = ( relative_instruction_beginning + relative_instruction_ending ) / 2;
+  const auto inst_box_width = relative_instruction_ending - relative_instruction_beginning;
+
+  const auto cycle_box_middle = ( relative_cycle_beginning + relative_cycle_ending ) / 2;
+  const auto cycle_box_width = relative_cycle_ending - relative_cycle_beginning;
+
+  cout << inst_box_middle << " " << ipc << " " << inst_box_width << " ";
+  cout << cycle_box_middle << " " << ipc << " " << cycle_box_width << "\n";
+}
+
+// Summary of the recovery curve, for the results file
+struct IPCSummary
+{
+  double first_iteration_ipc; // in the first interval after the syscall
+  double steady_state_ipc;    // over the second quarter of the run, before the syscall
+};
+
+double ipc_between( long long pre_instructions,
+                    long long pre_cycles,
+                    long long post_instructions,
+                    long long post_cycles )
+{
+  return double( post_instructions - pre_instructions ) / double( post_cycles - pre_cycles );
+}
 
+// Read the counters before and after every iteration
+IPCSummary measure_every_iteration( Workload& workload, int fd, const Disruption& disruption, bool branchy )
+{
   // Initialize monitoring of IPC (instructions per cycle)
   IPCCounter perf;
   vector<SamplePair> samples( total_iterations );
@@ -137,21 +239,7 @@ int main( int argc, char* argv[] )
       samples.at( i - 1 ).post = sample;
     }
 
-    if ( i == system_call_at ) {
-      if ( do_syscall ) { // do 1-byte pwrite system call in this iteration
-        if ( 1 != CheckSystemCall( "pwrite", pwrite( fd, "x", 1, 0 ) ) ) {
-          throw runtime_error( "short write" );
-        }
-      } else { // copy one byte in user space (without a syscall)
-        trivial_memory_copy();
-      }
-    } else { // otherwise, do some computation
-      if ( branchy ) {
-        workload.do_branchy_computation( i );
-      } else {
-        workload.do_matrix_computation();
-      }
-    }
+    do_iteration( i, workload, fd, disruption, branchy );
   }
 
   samples.back().post = perf.read(); // final sample
@@ -163,26 +251,127 @@ int main( int argc, char* argv[] )
     if ( i == system_call_at ) {
       cout << "# ";
     }
-    const auto& sample = samples.at( i );
-    const auto relative_instruction_beginning = sample.pre.instructions - index_inst;
-    const auto relative_instruction_ending = sample.post.instructions - index_inst;
+    print_interval( samples.at( i ), index_inst, index_cycle );
+  }
+
+  const auto& first_after = samples.at( system_call_at + 1 );
+  const auto& steady_beginning = samples.at( system_call_at / 2 ).pre;
+  const auto& steady_ending = samples.at( system_call_at - 1 ).post;
+  return { ipc_between( first_after.pre.instructions,
+                        first_after.pre.cycles,
+                        first_after.post.instructions,
+                        first_after.post.cycles ),
+           ipc_between( steady_beginning.instructions,
+                        steady_beginning.cycles,
+                        steady_ending.instructions,
+                        steady_ending.cycles ) };
+}
+
+// Let the kernel record the counters (with a timestamp) every sample_period user-space instructions,
+// and only read the TSC around the syscall. The IPC timeline is reconstructed afterwards.
+IPCSummary measure_sampled( Workload& workload,
+                            int fd,
+                            const Disruption& disruption,
+                            bool branchy,
+                            uint64_t sample_period )
+{
+  PerfSampler sampler { sample_period };
+  uint64_t syscall_beginning_tsc = 0, syscall_ending_tsc = 0;
+  sampler.start();
+
+  for ( unsigned int i = 0; i < total_iterations; ++i ) {
+    if ( i == system_call_at ) {
+      syscall_beginning_tsc = read_tsc();
+      do_iteration( i, workload, fd, disruption, branchy );
+      syscall_ending_tsc = read_tsc();
+    } else {
+      do_iteration( i, workload, fd, disruption, branchy );
+    }
+  }
+
+  sampler.stop();
+  sampler.drain();
+
+  const auto& samples = sampler.samples();
+  if ( sampler.lost_records() ) {
+    cerr << "Warning: " << sampler.lost_records() << " samples lost (increase sample_period)\n";
+  }
+
+  // the first sample taken after the syscall serves as the zero index
+  size_t first_after_syscall = 0;
+  while ( first_after_syscall < samples.size() && samples.at( first_after_syscall ).tsc < syscall_ending_tsc ) {
+    ++first_after_syscall;
+  }
+  if ( first_after_syscall < 2 || first_after_syscall + 1 >= samples.size() ) {
+    throw runtime_error( "no samples on both sides of the syscall (decrease sample_period)" );
+  }
+  const auto index_inst = static_cast<long long>( samples.at( first_after_syscall ).instructions );
+  const auto index_cycle = static_cast<long long>( samples.at( first_after_syscall ).cycles );
+
+  // Print each interval between consecutive samples; mark the one containing the syscall
+  for ( size_t i = 1; i < samples.size(); ++i ) {
+    const auto& pre = samples.at( i - 1 );
+    const auto& post = samples.at( i );
+    if ( pre.tsc <= syscall_beginning_tsc && post.tsc >= syscall_ending_tsc ) {
+      cout << "# ";
+    }
+    print_interval( { { static_cast<long long>( pre.instructions ), static_cast<long long>( pre.cycles ) },
+                      { static_cast<long long>( post.instructions ), static_cast<long long>( post.cycles ) } },
+                    index_inst,
+                    index_cycle );
+  }
 
-    const auto relative_cycle_beginning = sample.pre.cycles - index_cycle;
-    const auto relative_cycle_ending = sample.post.cycles - index_cycle;
+  // steady state: the second half of the intervals before the one containing the syscall
+  const auto& first_after = samples.at( first_after_syscall );
+  const auto& next = samples.at( first_after_syscall + 1 );
+  const auto& steady_beginning = samples.at( ( first_after_syscall - 1 ) / 2 );
+  const auto& steady_ending = samples.at( first_after_syscall - 1 );
+  return { ipc_between( first_after.instructions, first_after.cycles, next.instructions, next.cycles ),
+           ipc_between( steady_beginning.instructions,
+                        steady_beginning.cycles,
+                        steady_ending.instructions,
+                        steady_ending.cycles ) };
+}
 
-    const auto instructions = sample.post.instructions - sample.pre.instructions;
-    const auto cycles = sample.post.cycles - sample.pre.cycles;
-    const double ipc = double( instructions ) / double( cycles );
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
 
-    const auto inst_box_middle = ( relative_instruction_beginning + relative_instruction_ending ) / 2;
-    const auto inst_box_width = relative_instruction_ending - relative_instruction_beginning;
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  auto [disruption, branchy, sample_period] = process_arguments( args );
+
+  // Open dummy file
+  int fd = memfd_create( "dummy", 0 );
+  if ( fd < 0 ) {
+    throw runtime_error( "memfd_create" );
+  }
+
+  // Prevent CPU migration (except the one deliberately caused in a migration experiment)
+  lock_to_CPU( home_cpu );
+  if ( disruption.kind == Disruption::Kind::Migration ) {
+    cerr << "Migrating from CPU " << home_cpu << " to CPU " << disruption.target_cpu << "\n";
+  }
+
+  // Initialize compute "workload"
+  Workload workload;
 
-    const auto cycle_box_middle = ( relative_cycle_beginning + relative_cycle_ending ) / 2;
-    const auto cycle_box_width = relative_cycle_ending - relative_cycle_beginning;
+  const auto summary = sample_period ? measure_sampled( workload, fd, disruption, branchy, sample_period )
+                                     : measure_every_iteration( workload, fd, disruption, branchy );
 
-    cout << inst_box_middle << " " << ipc << " " << inst_box_width << " ";
-    cout << cycle_box_middle << " " << ipc << " " << cycle_box_width << "\n";
+  ResultsRecord record { "ipcfun" };
+  record.add_config( "disruption", string_view( args[1] ) );
+  record.add_config( "workload", branchy ? "branchy" : "matrix" );
+  record.add_config( "sample_period", sample_period );
+  if ( disruption.kind == Disruption::Kind::Migration ) {
+    record.add_config( "target_cpu", disruption.target_cpu );
   }
+  record.add_higher_is_better( "first_iteration_ipc", summary.first_iteration_ipc );
+  record.add_higher_is_better( "steady_state_ipc", summary.steady_state_ipc );
+  record.append_to_results_file();
 
   return EXIT_SUCCESS;
 }
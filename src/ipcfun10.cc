@@ -0,0 +1,453 @@
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <span>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "results.hh"
+#include "support.hh"
+
+using namespace std;
+
+// One direction of communication between the two processes
+class Link
+{
+public:
+  virtual void send( span<const char> message ) = 0;
+  virtual void receive( span<char> message ) = 0;
+  virtual bool carries_data() const { return true; }
+  virtual ~Link() = default;
+};
+
+// write or read a whole message on a byte-stream file descriptor
+void write_all( int fd, span<const char> message )
+{
+  while ( !message.empty() ) {
+    message = message.subspan( CheckSystemCall( "write", write( fd, message.data(), message.size() ) ) );
+  }
+}
+
+void read_all( int fd, span<char> message )
+{
+  while ( !message.empty() ) {
+    const auto bytes_read = CheckSystemCall( "read", read( fd, message.data(), message.size() ) );
+    if ( bytes_read == 0 ) {
+      throw runtime_error( "unexpected EOF" );
+    }
+    message = message.subspan( bytes_read );
+  }
+}
+
+// A pipe, or one direction of a UNIX-domain stream socket pair
+class StreamLink : public Link
+{
+  int read_fd_, write_fd_;
+
+public:
+  StreamLink( int read_fd, int write_fd ) : read_fd_( read_fd ), write_fd_( write_fd ) {}
+
+  static unique_ptr<Link> make_pipe()
+  {
+    int fds[2];
+    CheckSystemCall( "pipe", pipe( fds ) );
+    return make_unique<StreamLink>( fds[0], fds[1] );
+  }
+
+  static unique_ptr<Link> make_unix_socket()
+  {
+    int fds[2];
+    CheckSystemCall( "socketpair", socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) );
+    return make_unique<StreamLink>( fds[0], fds[1] );
+  }
+
+  void send( span<const char> message ) override { write_all( write_fd_, message ); }
+  void receive( span<char> message ) override { read_all( read_fd_, message ); }
+};
+
+// An eventfd in semaphore mode: each message is a wakeup that carries no data
+class EventfdLink : public Link
+{
+  int fd_;
+
+public:
+  EventfdLink() : fd_( CheckSystemCall( "eventfd", eventfd( 0, EFD_SEMAPHORE ) ) ) {}
+
+  void send( span<const char> ) override
+  {
+    const uint64_t one = 1;
+    if ( sizeof( one ) != CheckSystemCall( "write", write( fd_, &one, sizeof( one ) ) ) ) {
+      throw runtime_error( "short write to eventfd" );
+    }
+  }
+
+  void receive( span<char> ) override
+  {
+    uint64_t value;
+    if ( sizeof( value ) != CheckSystemCall( "read", read( fd_, &value, sizeof( value ) ) ) ) {
+      throw runtime_error( "short read from eventfd" );
+    }
+  }
+
+  bool carries_data() const override { return false; }
+};
+
+// A single-producer, single-consumer ring of fixed-size slots in shared memory. A side that
+// has to wait spins for a while, then sleeps on a futex until the other side wakes it.
+class SharedRingLink : public Link
+{
+  static constexpr uint32_t slot_count = 64;
+  static constexpr unsigned int spin_limit = 1000;
+
+  struct Control
+  {
+    alignas( 64 ) atomic<uint32_t> head { 0 }; // messages produced
+    alignas( 64 ) atomic<uint32_t> tail { 0 }; // messages consumed
+    alignas( 64 ) atomic<uint32_t> consumer_waiting { 0 }; // number of consumers about to sleep (0 or 1)
+    alignas( 64 ) atomic<uint32_t> producer_waiting { 0 }; // number of producers about to sleep (0 or 1)
+  };
+
+  size_t slot_size_;
+  size_t mapping_size_;
+  Control* control_;
+  char* slots_;
+
+  static void futex_wait( atomic<uint32_t>& word, uint32_t expected )
+  {
+    const long ret = syscall( SYS_futex, reinterpret_cast<uint32_t*>( &word ), FUTEX_WAIT, expected, nullptr );
+    if ( ret < 0 && errno != EAGAIN && errno != EINTR ) {
+      throw tagged_error( system_category(), "futex_wait", errno );
+    }
+  }
+
+  static void futex_wake( atomic<uint32_t>& word )
+  {
+    CheckSystemCall( "futex_wake", syscall( SYS_futex, reinterpret_cast<uint32_t*>( &word ), FUTEX_WAKE, 1 ) );
+  }
+
+  // Wait until `ready(word)` holds, spinning first, then sleeping on the word.
+  // Only the waiter changes its waiting count, and the waker only reads it, so a delayed waker can never
+  // clear a newer waiter's registration. Both sides use sequentially consistent operations: either the
+  // waker sees the count, or the waiter sees the new word (and a wake in between makes FUTEX_WAIT fail).
+  static void wait_for( atomic<uint32_t>& word, atomic<uint32_t>& waiting, auto ready )
+  {
+    for ( unsigned int i = 0; i < spin_limit; ++i ) {
+      if ( ready( word.load( memory_order_acquire ) ) ) {
+        return;
+      }
+      _mm_pause();
+    }
+
+    while ( true ) {
+      waiting.fetch_add( 1 );
+      const uint32_t observed = word.load();
+      if ( !ready( observed ) ) {
+        futex_wait( word, observed );
+      }
+      waiting.fetch_sub( 1 );
+      if ( ready( word.load() ) ) {
+        return;
+      }
+    }
+  }
+
+  static void wake( atomic<uint32_t>& word, const atomic<uint32_t>& waiting )
+  {
+    if ( waiting.load() ) {
+      futex_wake( word );
+    }
+  }
+
+public:
+  explicit SharedRingLink( size_t slot_size )
+    : slot_size_( slot_size )
+    , mapping_size_( sizeof( Control ) + slot_count * slot_size )
+    , control_( nullptr )
+    , slots_( nullptr )
+  {
+    void* mapping = mmap( nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( mapping == MAP_FAILED ) {
+      throw tagged_error( system_category(), "mmap", errno );
+    }
+    control_ = new ( mapping ) Control {};
+    slots_ = static_cast<char*>( mapping ) + sizeof( Control );
+  }
+
+  ~SharedRingLink() override { munmap( control_, mapping_size_ ); }
+
+  SharedRingLink( const SharedRingLink& ) = delete;
+  SharedRingLink& operator=( const SharedRingLink& ) = delete;
+
+  void send( span<const char> message ) override
+  {
+    const uint32_t head = control_->head.load( memory_order_relaxed );
+    wait_for(
+      control_->tail, control_->producer_waiting, [&]( uint32_t tail ) { return head - tail < slot_count; } );
+
+    memcpy( slots_ + ( head % slot_count ) * slot_size_, message.data(), message.size() );
+    control_->head.store( head + 1 );
+    wake( control_->head, control_->consumer_waiting );
+  }
+
+  void receive( span<char> message ) override
+  {
+    const uint32_t tail = control_->tail.load( memory_order_relaxed );
+    wait_for( control_->head, control_->consumer_waiting, [&]( uint32_t head ) { return head != tail; } );
+
+    memcpy( message.data(), slots_ + ( tail % slot_count ) * slot_size_, message.size() );
+    control_->tail.store( tail + 1 );
+    wake( control_->tail, control_->producer_waiting );
+  }
+};
+
+unique_ptr<Link> make_link( string_view transport, size_t message_size )
+{
+  if ( transport == "pipe"sv ) {
+    return StreamLink::make_pipe();
+  } else if ( transport == "unix"sv ) {
+    return StreamLink::make_unix_socket();
+  } else if ( transport == "eventfd"sv ) {
+    return make_unique<EventfdLink>();
+  } else if ( transport == "shm"sv ) {
+    return make_unique<SharedRingLink>( message_size );
+  }
+  throw runtime_error( "unknown transport" );
+}
+
+struct Report
+{
+  const char* role;
+  IPCCounter::Reading pre, post;
+  double seconds;
+};
+
+void print_report( const Report& report )
+{
+  cout << "# " << report.role << " user IPC: "
+       << double( report.post.instructions - report.pre.instructions )
+            / double( report.post.cycles - report.pre.cycles )
+       << " (" << report.post.instructions - report.pre.instructions << " instructions in "
+       << report.post.cycles - report.pre.cycles << " cycles, " << report.seconds << " s)\n";
+}
+
+// (percentile, nanoseconds) pairs
+vector<pair<double, double>> latency_percentiles( vector<uint64_t>& latencies, double tsc_ticks_per_second )
+{
+  vector<pair<double, double>> ret;
+  if ( latencies.empty() ) {
+    return ret;
+  }
+
+  sort( latencies.begin(), latencies.end() );
+  for ( const double percentile : { 50.0, 90.0, 99.0, 99.9, 100.0 } ) {
+    const auto index = min( latencies.size() - 1, size_t( percentile / 100.0 * double( latencies.size() ) ) );
+    ret.emplace_back( percentile, double( latencies.at( index ) ) * 1.0e9 / tsc_ticks_per_second );
+  }
+  return ret;
+}
+
+void print_latencies( const char* label, const vector<pair<double, double>>& percentiles )
+{
+  if ( percentiles.empty() ) {
+    return;
+  }
+
+  cout << "# " << label << " (ns):";
+  for ( const auto& [percentile, nanoseconds] : percentiles ) {
+    cout << " p" << percentile << "=" << nanoseconds;
+  }
+  cout << "\n";
+}
+
+void record_latencies( ResultsRecord& record, const char* label, const vector<pair<double, double>>& percentiles )
+{
+  for ( const auto& [percentile, nanoseconds] : percentiles ) {
+    ostringstream key;
+    key << label << "_ns.p" << percentile;
+    record.add_lower_is_better( key.str(), nanoseconds );
+  }
+}
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0]
+       << " transport [=\"pipe\" or \"unix\" or \"eventfd\" or \"shm\"] pattern [=\"pingpong\" or \"stream\"]"
+          " message_count message_size sender_cpu receiver_cpu\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() != 7 ) {
+    usage_error( args );
+  }
+  const string_view transport = args[1];
+  bool pingpong;
+  if ( args[2] == "pingpong"sv ) {
+    pingpong = true;
+  } else if ( args[2] == "stream"sv ) {
+    pingpong = false;
+  } else {
+    usage_error( args );
+  }
+  const auto message_count = to_uint64( args[3] );
+  const auto message_size = to_uint64( args[4] );
+  const auto sender_cpu = to_uint64( args[5] );
+  const auto receiver_cpu = to_uint64( args[6] );
+
+  // each message carries its send timestamp, so it must fit one
+  if ( message_size < sizeof( uint64_t ) || message_count == 0 ) {
+    usage_error( args );
+  }
+
+  const double tsc_ticks_per_second = estimate_tsc_ticks_per_second();
+
+  // Create both directions before forking, so the two processes share them
+  auto to_receiver = make_link( transport, message_size );
+  auto to_sender = make_link( transport, message_size );
+  const bool one_way_latency = !pingpong && to_receiver->carries_data();
+
+  // Each process appends its own record (the receiver's holds the one-way latencies of a stream)
+  const auto make_record = [&]( string_view role ) {
+    ResultsRecord record { "ipcfun10" };
+    record.add_config( "role", role );
+    record.add_config( "transport", transport );
+    record.add_config( "pattern", string_view( args[2] ) );
+    record.add_config( "message_count", message_count );
+    record.add_config( "message_size", message_size );
+    record.add_config( "sender_cpu", sender_cpu );
+    record.add_config( "receiver_cpu", receiver_cpu );
+    record.add_calibration( "tsc_ticks_per_second", tsc_ticks_per_second );
+    return record;
+  };
+
+  cout << "# Transport: " << transport << ", pattern: " << args[2] << ", " << message_count << " messages of "
+       << message_size << " bytes, sender on CPU " << sender_cpu << ", receiver on CPU " << receiver_cpu << "\n";
+  cout.flush();
+
+  const pid_t child = CheckSystemCall( "fork", fork() );
+
+  if ( child == 0 ) {
+    // Receiver: echo every message (pingpong), or consume them all and then acknowledge (stream)
+    try {
+      lock_to_CPU( receiver_cpu );
+      vector<char> message( message_size );
+      vector<uint64_t> latencies;
+      latencies.reserve( one_way_latency ? message_count : 0 );
+
+      IPCCounter perf;
+      perf.start();
+      Report report { "receiver", perf.read(), {}, 0 };
+      const auto beginning = read_tsc();
+
+      for ( uint64_t i = 0; i < message_count; ++i ) {
+        to_receiver->receive( message );
+        if ( pingpong ) {
+          to_sender->send( message );
+        } else if ( one_way_latency ) {
+          uint64_t sent_tsc;
+          memcpy( &sent_tsc, message.data(), sizeof( sent_tsc ) );
+          latencies.push_back( read_tsc() - sent_tsc );
+        }
+      }
+      if ( !pingpong ) {
+        to_sender->send( message );
+      }
+
+      report.seconds = double( read_tsc() - beginning ) / tsc_ticks_per_second;
+      report.post = perf.read();
+
+      print_report( report );
+      const auto percentiles = latency_percentiles( latencies, tsc_ticks_per_second );
+      print_latencies( "one-way latency", percentiles );
+      cout.flush();
+
+      if ( one_way_latency ) {
+        auto record = make_record( "receiver" );
+        record_latencies( record, "one_way_latency", percentiles );
+        record.append_to_results_file();
+      }
+    } catch ( const exception& e ) {
+      cerr << "receiver: " << e.what() << "\n";
+      _exit( EXIT_FAILURE );
+    }
+    _exit( EXIT_SUCCESS );
+  }
+
+  // Sender: send messages stamped with the TSC, timing round trips (pingpong) or the whole stream
+  lock_to_CPU( sender_cpu );
+  vector<char> message( message_size, 'x' );
+  vector<uint64_t> latencies;
+  latencies.reserve( pingpong ? message_count : 0 );
+
+  IPCCounter perf;
+  perf.start();
+  Report report { "sender", perf.read(), {}, 0 };
+  const auto beginning = read_tsc();
+
+  for ( uint64_t i = 0; i < message_count; ++i ) {
+    const uint64_t sent_tsc = read_tsc();
+    memcpy( message.data(), &sent_tsc, sizeof( sent_tsc ) );
+    to_receiver->send( message );
+    if ( pingpong ) {
+      to_sender->receive( message );
+      latencies.push_back( read_tsc() - sent_tsc );
+    }
+  }
+  if ( !pingpong ) {
+    to_sender->receive( message );
+  }
+
+  const auto ending = read_tsc();
+  report.post = perf.read();
+  report.seconds = double( ending - beginning ) / tsc_ticks_per_second;
+
+  int status;
+  CheckSystemCall( "waitpid", waitpid( child, &status, 0 ) );
+  if ( !WIFEXITED( status ) || WEXITSTATUS( status ) != EXIT_SUCCESS ) {
+    throw runtime_error( "receiver failed" );
+  }
+
+  print_report( report );
+  const auto percentiles = latency_percentiles( latencies, tsc_ticks_per_second );
+  print_latencies( "round-trip latency", percentiles );
+
+  // (an eventfd only signals, so it moves no message bytes)
+  const double messages_per_second = double( message_count ) / report.seconds;
+  const double bytes_per_second = double( message_count * message_size ) / report.seconds;
+  cout << "# Throughput: " << messages_per_second << " messages/s";
+  if ( to_receiver->carries_data() ) {
+    cout << ", " << bytes_per_second << " bytes/s";
+  }
+  cout << "\n";
+
+  auto record = make_record( "sender" );
+  record.add_higher_is_better( "messages_per_second", messages_per_second );
+  if ( to_receiver->carries_data() ) {
+    record.add_higher_is_better( "bytes_per_second", bytes_per_second );
+  }
+  record_latencies( record, "round_trip_latency", percentiles );
+  record.append_to_results_file();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <span>
+#include <utility>
+
+#include "results.hh"
+#include "support.hh"
+
+using namespace std;
+
+/*
+  Instruction-footprint workload: do_computation() calls a set of functions that are generated at
+  compile time, each made of straight-line code, so the working set lives in the i-cache and iTLB
+  rather than the data caches. The footprint is configurable when compiling, e.g.
+  -DCODE_FUNCTION_COUNT=256 -DCODE_FUNCTION_BYTES=2048 -DCODE_FUNCTION_ALIGNMENT=4096
+*/
+#ifndef CODE_FUNCTION_COUNT
+#define CODE_FUNCTION_COUNT 64 // number of generated functions
+#endif
+
+#ifndef CODE_FUNCTION_BYTES
+#define CODE_FUNCTION_BYTES 1024 // bytes of straight-line code in each function (multiple of 4)
+#endif
+
+#ifndef CODE_FUNCTION_ALIGNMENT
+#define CODE_FUNCTION_ALIGNMENT 4096 // 4096 puts every function on its own page (one iTLB entry each)
+#endif
+
+constexpr size_t code_function_count = CODE_FUNCTION_COUNT;
+constexpr size_t code_function_bytes = CODE_FUNCTION_BYTES;
+static_assert( code_function_bytes % 4 == 0, "code is generated as 4-byte instructions" );
+
+// A function with code_function_bytes of 4-byte NOPs: cheap to execute, but they all have to be fetched
+template<size_t I>
+[[gnu::noinline, gnu::aligned( CODE_FUNCTION_ALIGNMENT )]] uint64_t code_block( uint64_t x )
+{
+  asm volatile( ".rept %c1\n\t"
+                ".byte 0x0f, 0x1f, 0x40, 0x00\n\t" // nopl 0x0(%rax)
+                ".endr"
+                : "+r"( x )
+                : "i"( code_function_bytes / 4 ) );
+  return x + I;
+}
+
+template<size_t... I>
+constexpr array<uint64_t ( * )( uint64_t ), sizeof...( I )> make_code_blocks( index_sequence<I...> )
+{
+  return { &code_block<I>... };
+}
+
+class Workload
+{
+  array<uint64_t ( * )( uint64_t ), code_function_count> functions_ {
+    make_code_blocks( make_index_sequence<code_function_count> {} ) };
+  uint64_t state_ {};
+
+public:
+  Workload()
+  {
+    // call the functions in a fixed random order, so the next-line prefetcher can't hide the misses
+    shuffle( functions_.begin(), functions_.end(), mt19937 { 0 } );
+  }
+
+  void do_computation()
+  {
+    for ( const auto function : functions_ ) {
+      state_ = function( state_ );
+    }
+  }
+
+  uint64_t state() const { return state_; }
+};
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0] << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\"]\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() != 3 ) {
+    usage_error( args );
+  }
+  auto total_iterations = to_uint64( args[1] );
+  auto when = args[2];
+  bool syscalls_at_end, syscalls_interspersed;
+
+  if ( when == "at_end"sv ) {
+    syscalls_at_end = true;
+    syscalls_interspersed = false;
+  } else if ( when == "interspersed"sv ) {
+    syscalls_at_end = false;
+    syscalls_interspersed = true;
+  } else if ( when == "never"sv ) {
+    syscalls_at_end = false;
+    syscalls_interspersed = false;
+  } else {
+    usage_error( args );
+  }
+
+  // Open dummy file
+  int fd = memfd_create( "dummy", 0 );
+  if ( fd < 0 ) {
+    throw runtime_error( "memfd_create" );
+  }
+
+  // Initialize compute "workload"
+  Workload workload;
+
+  uint64_t syscall_count = 0;
+  const auto run_beginning = chrono::steady_clock::now();
+
+  // In each iteration, run through the whole code footprint.
+  // Also, sometimes do a syscall (which evicts part of the i-cache and iTLB).
+  for ( size_t i = 0; i < total_iterations; ++i ) {
+    workload.do_computation();
+
+    if ( syscalls_interspersed ) {
+      if ( 0 != pwrite( fd, nullptr, 0, 0 ) ) {
+        throw runtime_error( "pwrite returned error" );
+      }
+      ++syscall_count;
+    }
+  }
+
+  if ( syscalls_at_end ) {
+    for ( size_t i = 0; i < total_iterations; ++i ) {
+      if ( 0 != pwrite( fd, nullptr, 0, 0 ) ) {
+        throw runtime_error( "pwrite returned error" );
+      }
+      ++syscall_count;
+    }
+  }
+
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - run_beginning;
+
+  cerr << "Iterations: " << total_iterations << "\n";
+  cerr << "Syscall count: " << syscall_count << "\n";
+  cerr << "Syscalls interspersed: " << syscalls_interspersed << "\n";
+  cerr << "Syscalls all at the end: " << syscalls_at_end << "\n";
+  cerr << "Code footprint: " << code_function_count << " functions of " << code_function_bytes
+       << " bytes, aligned to " << CODE_FUNCTION_ALIGNMENT << " bytes\n";
+  cerr << "Elapsed seconds: " << elapsed.count() << "\n";
+  cerr << "Final state: " << workload.state() << "\n";
+
+  ResultsRecord record { "ipcfun11" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "when", when );
+  record.add_config( "code_function_count", code_function_count );
+  record.add_config( "code_function_bytes", code_function_bytes );
+  record.add_config( "code_function_alignment", CODE_FUNCTION_ALIGNMENT );
+  record.add_higher_is_better( "iterations_per_second", double( total_iterations ) / elapsed.count() );
+  record.append_to_results_file();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,220 @@
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "results.hh"
+#include "support.hh"
+
+using namespace std;
+
+constexpr size_t total_iterations = 100000;
+constexpr size_t system_call_at = total_iterations / 2;
+constexpr size_t recovery_window = 100; // iterations after the syscall counted towards its misprediction cost
+
+/*
+  Branch-predictor workload: each iteration executes every one of BRANCH_SITE_COUNT static
+  conditional branches once. Site s is taken in iteration i according to a pattern that repeats
+  every `period` iterations, so a predictor with enough history predicts every branch correctly
+  in steady state, and mispredictions after a syscall come from predictor state lost in the kernel.
+  The number of sites is fixed when compiling, e.g. -DBRANCH_SITE_COUNT=512
+*/
+#ifndef BRANCH_SITE_COUNT
+#define BRANCH_SITE_COUNT 64
+#endif
+
+constexpr size_t branch_site_count = BRANCH_SITE_COUNT;
+
+struct SamplePair
+{
+  BranchCounter::Reading pre, post;
+};
+
+// One static conditional branch (asm goto, so the compiler cannot turn it into a cmov)
+template<size_t I>
+[[gnu::noinline]] uint64_t branch_site( uint8_t taken, uint64_t x )
+{
+  asm goto( "test %0, %0\n\t"
+            "jnz %l[was_taken]"
+            :
+            : "r"( taken )
+            : "cc"
+            : was_taken );
+  return x + 1;
+
+was_taken:
+  return x ^ I;
+}
+
+template<size_t... I>
+uint64_t run_branch_sites( index_sequence<I...>, const uint8_t* outcomes, uint64_t x )
+{
+  ( ( x = branch_site<I>( outcomes[I], x ) ), ... );
+  return x;
+}
+
+class Workload
+{
+  size_t period_;
+  vector<uint8_t> outcomes_; // period_ rows of branch_site_count outcomes
+  uint64_t state_ {};
+
+public:
+  Workload( string_view pattern, size_t period )
+    : period_( period ), outcomes_( period * branch_site_count )
+  {
+    mt19937 generator { 0 }; // consistent patterns across benchmark runs
+    for ( size_t phase = 0; phase < period_; ++phase ) {
+      for ( size_t site = 0; site < branch_site_count; ++site ) {
+        uint8_t& outcome = outcomes_.at( phase * branch_site_count + site );
+        if ( pattern == "taken"sv ) {
+          outcome = 1;
+        } else if ( pattern == "alternating"sv ) {
+          outcome = ( phase + site ) % 2;
+        } else if ( pattern == "random"sv ) {
+          outcome = generator() % 2;
+        } else {
+          throw runtime_error( "unknown pattern" );
+        }
+      }
+    }
+  }
+
+  void do_computation( size_t i )
+  {
+    const uint8_t* outcomes = outcomes_.data() + ( i % period_ ) * branch_site_count;
+    state_ = run_branch_sites( make_index_sequence<branch_site_count> {}, outcomes, state_ );
+  }
+
+  uint64_t state() const { return state_; }
+};
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0]
+       << " \"syscall\"/\"nosyscall\" pattern [=\"taken\" or \"alternating\" or \"random\"] period\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() != 4 ) {
+    usage_error( args );
+  }
+
+  bool do_syscall;
+  if ( args[1] == "syscall"sv ) {
+    do_syscall = true;
+  } else if ( args[1] == "nosyscall"sv ) {
+    do_syscall = false;
+  } else {
+    usage_error( args );
+  }
+  const string_view pattern = args[2];
+  const auto period = to_uint64( args[3] );
+  if ( period == 0 ) {
+    usage_error( args );
+  }
+
+  // Open dummy file
+  int fd = memfd_create( "dummy", 0 );
+  if ( fd < 0 ) {
+    throw runtime_error( "memfd_create" );
+  }
+
+  // Prevent CPU migration
+  lock_to_CPU_zero();
+
+  // Initialize compute "workload"
+  Workload workload { pattern, period };
+
+  // Initialize monitoring of IPC and branch mispredictions
+  BranchCounter perf;
+  vector<SamplePair> samples( total_iterations );
+  perf.start();
+
+  // In each iteration, run through the branch sites, or do the system call
+  for ( unsigned int i = 0; i < total_iterations; ++i ) {
+    const auto sample = perf.read();
+    samples.at( i ).pre = sample;
+    if ( i > 0 ) {
+      samples.at( i - 1 ).post = sample;
+    }
+
+    if ( i == system_call_at ) {
+      if ( do_syscall ) { // do 1-byte pwrite system call in this iteration
+        if ( 1 != CheckSystemCall( "pwrite", pwrite( fd, "x", 1, 0 ) ) ) {
+          throw runtime_error( "short write" );
+        }
+      }
+    } else {
+      workload.do_computation( i );
+    }
+  }
+
+  samples.back().post = perf.read(); // final sample
+
+  // Print the recorded performance counter data (same columns as ipcfun, plus mispredictions)
+  const auto index_inst = samples.at( system_call_at ).post.instructions; // zero index = immediately after syscall
+  const auto index_cycle = samples.at( system_call_at ).post.cycles;      // zero index = immediately after syscall
+  for ( unsigned int i = 0; i < total_iterations - 1; ++i ) {
+    if ( i == system_call_at ) {
+      cout << "# ";
+    }
+    const auto& sample = samples.at( i );
+    const auto relative_instruction_beginning = sample.pre.instructions - index_inst;
+    const auto relative_instruction_ending = sample.post.instructions - index_inst;
+
+    const auto relative_cycle_beginning = sample.pre.cycles - index_cycle;
+    const auto relative_cycle_ending = sample.post.cycles - index_cycle;
+
+    const auto instructions = sample.post.instructions - sample.pre.instructions;
+    const auto cycles = sample.post.cycles - sample.pre.cycles;
+    const double ipc = double( instructions ) / double( cycles );
+
+    const auto inst_box_middle = ( relative_instruction_beginning + relative_instruction_ending ) / 2;
+    const auto inst_box_width = relative_instruction_ending - relative_instruction_beginning;
+
+    const auto cycle_box_middle = ( relative_cycle_beginning + relative_cycle_ending ) / 2;
+    const auto cycle_box_width = relative_cycle_ending - relative_cycle_beginning;
+
+    cout << inst_box_middle << " " << ipc << " " << inst_box_width << " ";
+    cout << cycle_box_middle << " " << ipc << " " << cycle_box_width << " ";
+    cout << sample.post.mispredictions - sample.pre.mispredictions << "\n";
+  }
+
+  // Quantify the syscall's cost in mispredictions: compare the window after it with the
+  // steady state measured over the same number of iterations just before it
+  const auto mispredictions_between = [&]( size_t first, size_t last ) {
+    return samples.at( last ).post.mispredictions - samples.at( first ).pre.mispredictions;
+  };
+  const auto before = mispredictions_between( system_call_at - recovery_window, system_call_at - 1 );
+  const auto after = mispredictions_between( system_call_at + 1, system_call_at + recovery_window );
+
+  cout << "# Branch sites: " << branch_site_count << ", pattern: " << pattern << ", period: " << period << "\n";
+  cout << "# Mispredictions in " << recovery_window << " iterations before syscall: " << before << "\n";
+  cout << "# Mispredictions in " << recovery_window << " iterations after syscall: " << after << "\n";
+  cout << "# Excess mispredictions attributable to syscall: " << after - before << "\n";
+  cerr << "Final state: " << workload.state() << "\n";
+
+  ResultsRecord record { "ipcfun12" };
+  record.add_config( "syscall", do_syscall );
+  record.add_config( "pattern", pattern );
+  record.add_config( "period", period );
+  record.add_config( "branch_site_count", branch_site_count );
+  record.add_lower_is_better( "excess_mispredictions", after - before );
+  record.append_to_results_file();
+
+  return EXIT_SUCCESS;
+}
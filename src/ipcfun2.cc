@@ -4,9 +4,13 @@
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <span>
 #include <vector>
 
+#include "calibration.hh"
+#include "perf_event.hh"
+#include "results.hh"
 #include "support.hh"
 
 using namespace std;
@@ -27,20 +31,45 @@ class Workload
   unique_ptr<T2> matrix2 { make_unique<T2>() };
   unique_ptr<T3> matrix3 { make_unique<T3>() };
 
+  size_t repetitions_; // matrix multiplications per iteration
+
 public:
-  Workload()
+  explicit Workload( size_t repetitions )
+    : repetitions_( repetitions )
   {
     matrix1->Random();
     matrix2->Random();
     matrix3->Random();
   }
 
-  void do_matrix_computation() { *matrix3 = *matrix1 * *matrix2; }
+  void do_matrix_computation()
+  {
+    if ( repetitions_ == 1 ) { // the body the hand-measured instructions per iteration (below) describe
+      *matrix3 = *matrix1 * *matrix2;
+      return;
+    }
+
+    for ( size_t i = 0; i < repetitions_; ++i ) {
+      *matrix3 = *matrix1 * *matrix2;
+      asm volatile( "" : : "r"( matrix3->data() ) : "memory" ); // keep each repetition
+    }
+  }
+};
+
+// how each iteration is timed (TSC ticks, except for rdpmc which counts core cycles directly)
+enum class Timer
+{
+  Fenced, // read_tsc(): mfence; lfence; rdtsc; lfence
+  Lfence, // lfence; rdtsc; lfence
+  Rdtscp, // rdtscp; lfence
+  Rdpmc   // lfence; rdpmc (user-space cycle counter); lfence
 };
 
 void usage_error( span<char*> args )
 {
-  cerr << "Usage: " << args[0] << " interval\n";
+  cerr << "Usage: " << args[0]
+       << " total_iterations interval [timer=\"fenced\" or \"lfence\" or \"rdtscp\" or \"rdpmc\""
+          " [instructions_per_iteration]]\n";
   throw runtime_error( "invalid usage" );
 }
 
@@ -53,47 +82,99 @@ int main( int argc, char* argv[] )
     abort();
   }
   auto args = span( argv, argc );
-  if ( args.size() != 3 ) {
+  if ( args.size() < 3 || args.size() > 5 ) {
     usage_error( args );
   }
   auto total_iterations = to_uint64( args[1] );
   auto interval = to_uint64( args[2] );
 
+  const string_view timer_name = args.size() >= 4 ? args[3] : "fenced";
+  Timer timer;
+  if ( timer_name == "fenced"sv ) {
+    timer = Timer::Fenced;
+  } else if ( timer_name == "lfence"sv ) {
+    timer = Timer::Lfence;
+  } else if ( timer_name == "rdtscp"sv ) {
+    timer = Timer::Rdtscp;
+  } else if ( timer_name == "rdpmc"sv ) {
+    timer = Timer::Rdpmc;
+  } else {
+    usage_error( args );
+  }
+
   // Open dummy file
   int fd = memfd_create( "dummy", 0 );
   if ( fd < 0 ) {
     throw runtime_error( "memfd_create" );
   }
 
+  // Optionally, calibrate the number of multiplications per iteration to a requested number of instructions
+  optional<WorkloadCalibration> calibration;
+  if ( args.size() == 5 ) {
+    calibration = calibrate_workload_size(
+      to_uint64( args[4] ),
+      { 1, 2, 4 },
+      []( size_t size ) { return Workload { size }; },
+      []( Workload& w ) { w.do_matrix_computation(); } );
+  }
+  const size_t repetitions = calibration ? calibration->size : 1;
+
   // Initialize compute "workload"
-  Workload workload;
+  Workload workload { repetitions };
 
   // Store TSC samples
   vector<SamplePair> samples( total_iterations );
 
   uint64_t syscall_count = 0;
+  uint64_t measurement_floor = 0;
+
+  auto run = [&]( const auto& read_time ) {
+    // Calibrate: the cost of the timer itself, which lands inside every sample
+    measurement_floor = measure_timer_floor( read_time );
 
-  // In each iteration, do computation and record the TSC before and after.
-  // Also, sometimes do a syscall at user-controlled interval (outside the pair of TSC samples).
-  for ( size_t i = 0; i < total_iterations; ++i ) {
-    samples.at( i ).pre = read_tsc();
+    // In each iteration, do computation and record the time before and after.
+    // Also, sometimes do a syscall at user-controlled interval (outside the pair of time samples).
+    for ( size_t i = 0; i < total_iterations; ++i ) {
+      samples.at( i ).pre = read_time();
 
-    workload.do_matrix_computation();
+      workload.do_matrix_computation();
 
-    samples.at( i ).post = read_tsc();
+      samples.at( i ).post = read_time();
 
-    if ( i % interval == ( interval - 1 ) ) {
-      if ( 0 != pwrite( fd, nullptr, 0, 0 ) ) {
-        throw runtime_error( "pwrite returned error" );
+      if ( i % interval == ( interval - 1 ) ) {
+        if ( 0 != pwrite( fd, nullptr, 0, 0 ) ) {
+          throw runtime_error( "pwrite returned error" );
+        }
+        syscall_count++;
       }
-      syscall_count++;
+    }
+  };
+
+  switch ( timer ) {
+    case Timer::Fenced:
+      run( [] { return read_tsc(); } );
+      break;
+    case Timer::Lfence:
+      run( [] { return read_tsc_lfence(); } );
+      break;
+    case Timer::Rdtscp:
+      run( [] { return read_tscp(); } );
+      break;
+    case Timer::Rdpmc: {
+      CycleCounter counter;
+      run( [&] { return counter.read(); } );
+      if ( counter.fallback_reads() ) {
+        cerr << "Warning: " << counter.fallback_reads() << " cycle counter readings fell back to read()\n";
+      }
+      break;
     }
   }
 
-  // Print the recorded performance counter data
+  // Print the recorded performance counter data, less the measurement floor
   uint64_t total_tsc_in_user_code {};
   for ( const auto& sample : samples ) {
-    total_tsc_in_user_code += ( sample.post - sample.pre );
+    const uint64_t elapsed = sample.post - sample.pre;
+    total_tsc_in_user_code += elapsed - min( elapsed, measurement_floor );
   }
 
   /*
@@ -122,13 +203,23 @@ int main( int argc, char* argv[] )
     TSC ticks per second = 28562935220 / (17.884952007 seconds) = 1597.0373 megahertz
     Cycles per TSC tick = 72804049462 / 28562935220 = 2.5489...
     Expected cycles per TSC tick = 4.1 GHz / 1.6 GHz = 2.5625...
+
+    With a requested number of instructions per iteration, the instructions
+    per iteration are measured at startup instead.
   */
-  static constexpr double instructions_per_iteration = 1246;
+  static constexpr double measured_instructions_per_iteration = 1246;
   static constexpr double cycles_per_tsc_tick = 2.548899;
+  const double instructions_per_iteration
+    = calibration ? calibration->instructions_per_iteration : measured_instructions_per_iteration;
+
+  // (with rdpmc, "TSC ticks" below are core cycles)
+  const double cycles_per_tick = timer == Timer::Rdpmc ? 1 : cycles_per_tsc_tick;
 
   double average_tsc_per_iteration = double( total_tsc_in_user_code ) / double( total_iterations );
-  double average_user_ipc = instructions_per_iteration / ( cycles_per_tsc_tick * average_tsc_per_iteration );
+  double average_user_ipc = instructions_per_iteration / ( cycles_per_tick * average_tsc_per_iteration );
 
+  cout << "# Timer: " << timer_name << ", measurement floor subtracted from each iteration: " << measurement_floor
+       << "\n";
   cout << "# Total TSC ticks: " << samples.back().post - samples.front().pre << "\n";
   cout << "# Total TSC ticks in user code: " << total_tsc_in_user_code << "\n";
   cout << "# Average TSC per iteration: " << average_tsc_per_iteration << "\n";
@@ -136,5 +227,17 @@ int main( int argc, char* argv[] )
   cout << "# Executed " << total_iterations << " iterations, with " << syscall_count << " syscalls.\n";
   cout << instructions_per_iteration * interval << " " << average_user_ipc << "\n";
 
+  ResultsRecord record { "ipcfun2" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "interval", interval );
+  record.add_config( "timer", timer_name );
+  record.add_config( "repetitions", repetitions );
+  record.add_calibration( "instructions_per_iteration", instructions_per_iteration );
+  record.add_calibration( "cycles_per_tick", cycles_per_tick );
+  record.add_calibration( "measurement_floor", measurement_floor );
+  record.add_lower_is_better( "average_tsc_per_iteration", average_tsc_per_iteration );
+  record.add_higher_is_better( "average_user_ipc", average_user_ipc );
+  record.append_to_results_file();
+
   return EXIT_SUCCESS;
 }
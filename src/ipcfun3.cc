@@ -6,6 +6,8 @@
 #include <memory>
 #include <span>
 
+#include "calibration.hh"
+#include "results.hh"
 #include "support.hh"
 
 using namespace std;
@@ -21,20 +23,36 @@ class Workload
   unique_ptr<T2> matrix2 { make_unique<T2>() };
   unique_ptr<T3> matrix3 { make_unique<T3>() };
 
+  size_t repetitions_; // matrix multiplications per iteration
+
 public:
-  Workload()
+  explicit Workload( size_t repetitions )
+    : repetitions_( repetitions )
   {
     matrix1->Random();
     matrix2->Random();
     matrix3->Random();
   }
 
-  void do_matrix_computation() { *matrix3 = *matrix1 * *matrix2; }
+  void do_matrix_computation()
+  {
+    if ( repetitions_ == 1 ) { // the original, uncalibrated body
+      *matrix3 = *matrix1 * *matrix2;
+      return;
+    }
+
+    for ( size_t i = 0; i < repetitions_; ++i ) {
+      *matrix3 = *matrix1 * *matrix2;
+      asm volatile( "" : : "r"( matrix3->data() ) : "memory" ); // keep each repetition
+    }
+  }
 };
 
 void usage_error( span<char*> args )
 {
-  cerr << "Usage: " << args[0] << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\"]\n";
+  cerr << "Usage: " << args[0]
+       << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\"]"
+          " [instructions_per_iteration]\n";
   throw runtime_error( "invalid usage" );
 }
 
@@ -47,7 +65,7 @@ int main( int argc, char* argv[] )
     abort();
   }
   auto args = span( argv, argc );
-  if ( args.size() != 3 ) {
+  if ( args.size() != 3 && args.size() != 4 ) {
     usage_error( args );
   }
   auto total_iterations = to_uint64( args[1] );
@@ -73,10 +91,25 @@ int main( int argc, char* argv[] )
     throw runtime_error( "memfd_create" );
   }
 
+  // Size the compute "workload": by default one multiplication per iteration, or calibrated to hit
+  // a requested number of instructions per iteration
+  size_t repetitions = 1;
+  if ( args.size() == 4 ) {
+    const auto calibration = calibrate_workload_size(
+      to_uint64( args[3] ),
+      { 1, 2, 4 },
+      []( size_t size ) { return Workload { size }; },
+      []( Workload& w ) { w.do_matrix_computation(); } );
+    repetitions = calibration.size;
+    cerr << "Calibrated repetitions: " << repetitions << " (" << calibration.instructions_per_iteration
+         << " instructions per iteration)\n";
+  }
+
   // Initialize compute "workload"
-  Workload workload;
+  Workload workload { repetitions };
 
   uint64_t syscall_count = 0;
+  const auto run_beginning = chrono::steady_clock::now();
 
   // In each iteration, do computation and record the TSC before and after.
   // Also, sometimes do a syscall at user-controlled interval (outside the pair of TSC samples).
@@ -100,10 +133,20 @@ int main( int argc, char* argv[] )
     }
   }
 
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - run_beginning;
+
   cerr << "Iterations: " << total_iterations << "\n";
   cerr << "Syscall count: " << syscall_count << "\n";
   cerr << "Syscalls interspersed: " << syscalls_interspersed << "\n";
   cerr << "Syscalls all at the end: " << syscalls_at_end << "\n";
+  cerr << "Elapsed seconds: " << elapsed.count() << "\n";
+
+  ResultsRecord record { "ipcfun3" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "when", when );
+  record.add_config( "repetitions", repetitions );
+  record.add_higher_is_better( "iterations_per_second", double( total_iterations ) / elapsed.count() );
+  record.append_to_results_file();
 
   return EXIT_SUCCESS;
 }
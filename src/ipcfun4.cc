@@ -3,23 +3,34 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <span>
 #include <vector>
 
+#include "calibration.hh"
+#include "coalescing_writer.hh"
+#include "results.hh"
 #include "support.hh"
 
 using namespace std;
 
+// tuned so the Workload::do_computation() method takes about 1,000 instructions
+// (6 instructions per loop iteration: add add mov add cmp jne), unless calibrated at startup
+constexpr size_t default_loop_count = 167;
+
 class Workload
 {
-  size_t loop_count_ { 167 }; // tuned so the Workload::do_computation() method takes about 1,000 instructions
-                              // (6 instructions per loop iteration: add add mov add cmp jne)
+  size_t loop_count_;
   size_t page_size_;
   size_t stride_;
   vector<uint8_t> data_;
 
 public:
-  Workload() : page_size_( getpagesize() ), stride_( page_size_ + 1 ), data_( stride_ * loop_count_, 0 )
+  explicit Workload( size_t loop_count )
+    : loop_count_( loop_count )
+    , page_size_( getpagesize() )
+    , stride_( page_size_ + 1 )
+    , data_( stride_ * loop_count_, 0 )
   {
     for ( size_t i = 0; i < stride_ * loop_count_; ++i ) {
       data_.at( i ) = rand();
@@ -43,7 +54,9 @@ public:
 
 void usage_error( span<char*> args )
 {
-  cerr << "Usage: " << args[0] << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\"]\n";
+  cerr << "Usage: " << args[0]
+       << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\" or \"coalesced\" or"
+          " \"adaptive\"] [instructions_per_iteration]\n";
   throw runtime_error( "invalid usage" );
 }
 
@@ -56,12 +69,13 @@ int main( int argc, char* argv[] )
     abort();
   }
   auto args = span( argv, argc );
-  if ( args.size() != 3 ) {
+  if ( args.size() != 3 && args.size() != 4 ) {
     usage_error( args );
   }
   auto total_iterations = to_uint64( args[1] );
   auto when = args[2];
   bool syscalls_at_end, syscalls_interspersed;
+  bool syscalls_coalesced = false;
 
   if ( when == "at_end"sv ) {
     syscalls_at_end = true;
@@ -72,6 +86,10 @@ int main( int argc, char* argv[] )
   } else if ( when == "never"sv ) {
     syscalls_at_end = false;
     syscalls_interspersed = false;
+  } else if ( when == "coalesced"sv || when == "adaptive"sv ) {
+    syscalls_at_end = false;
+    syscalls_interspersed = false;
+    syscalls_coalesced = true;
   } else {
     usage_error( args );
   }
@@ -82,14 +100,55 @@ int main( int argc, char* argv[] )
     throw runtime_error( "memfd_create" );
   }
 
+  // Size the compute "workload": by default the hand-tuned loop count, or calibrated to hit
+  // a requested number of instructions per iteration
+  size_t loop_count = default_loop_count;
+  if ( args.size() == 4 ) {
+    const auto calibration = calibrate_workload_size(
+      to_uint64( args[3] ),
+      { default_loop_count / 2, default_loop_count, default_loop_count * 2 },
+      []( size_t size ) { return Workload { size }; },
+      []( Workload& w ) { w.do_computation(); } );
+    loop_count = calibration.size;
+    cerr << "Calibrated loop count: " << loop_count << " (" << calibration.instructions_per_iteration
+         << " instructions per iteration)\n";
+  }
+
   // Initialize compute "workload"
-  Workload workload;
+  Workload workload { loop_count };
+
+  // For the coalesced modes, the interspersed writes go through a user-space buffer that is flushed with one
+  // pwritev per batch: of 16 writes ("coalesced"), or of a size adapted to the measured flush cost ("adaptive").
+  // Either way, a batch is flushed once its oldest write is 1 ms old.
+  // Only the adaptive policy looks at the work's duration, so only it pays for timing each iteration.
+  const bool adaptive = when == "adaptive"sv;
+  unique_ptr<CoalescingWriter> writer;
+  if ( syscalls_coalesced ) {
+    const CoalescingWriter::Policy policy {
+      64 * 1024, 16, uint64_t( estimate_tsc_ticks_per_second() / 1000 ), adaptive, 0.01 };
+    writer = make_unique<CoalescingWriter>( fd, 0, policy );
+  }
 
   uint64_t syscall_count = 0;
+  const auto run_beginning = chrono::steady_clock::now();
 
   // In each iteration, do computation and record the TSC before and after.
   // Also, sometimes do a syscall at user-controlled interval (outside the pair of TSC samples).
   for ( size_t i = 0; i < total_iterations; ++i ) {
+    if ( syscalls_coalesced ) {
+      if ( adaptive ) {
+        // time the computation, so the adaptive policy can see the indirect cost of each flush
+        // (unfenced, to keep the timing itself cheap relative to a ~1,000-instruction iteration)
+        const auto work_beginning = __rdtsc();
+        workload.do_computation();
+        writer->note_work( __rdtsc() - work_beginning );
+      } else {
+        workload.do_computation();
+      }
+      writer->write( {} );
+      continue;
+    }
+
     workload.do_computation();
 
     if ( syscalls_interspersed ) {
@@ -109,10 +168,35 @@ int main( int argc, char* argv[] )
     }
   }
 
+  if ( syscalls_coalesced ) {
+    writer->flush();
+    syscall_count += writer->flush_count();
+  }
+
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - run_beginning;
+
   cerr << "Iterations: " << total_iterations << "\n";
   cerr << "Syscall count: " << syscall_count << "\n";
   cerr << "Syscalls interspersed: " << syscalls_interspersed << "\n";
   cerr << "Syscalls all at the end: " << syscalls_at_end << "\n";
+  if ( syscalls_coalesced ) {
+    cerr << "Writes coalesced: " << writer->write_count() << "\n";
+    cerr << "Final write-count threshold: " << writer->max_writes() << "\n";
+    cerr << "Average write latency (TSC ticks): " << writer->average_latency_tsc() << "\n";
+    cerr << "Maximum write latency (TSC ticks): " << writer->max_latency_tsc() << "\n";
+  }
+  cerr << "Elapsed seconds: " << elapsed.count() << "\n";
+
+  ResultsRecord record { "ipcfun4" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "when", when );
+  record.add_config( "loop_count", loop_count );
+  if ( syscalls_coalesced ) {
+    record.add_lower_is_better( "syscall_count", syscall_count );
+    record.add_lower_is_better( "average_write_latency_tsc", writer->average_latency_tsc() );
+  }
+  record.add_higher_is_better( "iterations_per_second", double( total_iterations ) / elapsed.count() );
+  record.append_to_results_file();
 
   return EXIT_SUCCESS;
 }
@@ -6,12 +6,16 @@
 #include <iostream>
 #include <memory>
 #include <span>
+#include <vector>
 
+#include "calibration.hh"
+#include "coalescing_writer.hh"
+#include "results.hh"
 #include "support.hh"
 
 using namespace std;
 
-const int n_pages = 64;
+constexpr size_t default_n_pages = 64; // pages chased per iteration, unless calibrated at startup
 #define page_range 10240
 int a[page_range][1024];
 
@@ -33,8 +37,14 @@ class Workload
   unique_ptr<T2> matrix2 { make_unique<T2>() };
   unique_ptr<T3> matrix3 { make_unique<T3>() };
 
+  size_t n_pages_;
+
+  // every cache line touched by do_computation()'s pointer chase, in the order it touches them
+  vector<const void*> hot_set_ {};
+
 public:
-  Workload( unsigned int random_seed )
+  Workload( unsigned int random_seed, size_t n_pages )
+    : n_pages_( n_pages )
   {
     srand( random_seed ); // consistent seed for initialization across benchmark runs
 
@@ -46,12 +56,20 @@ public:
     }
 
     // initialize per original code
-    for ( int i = 0; i < n_pages; i++ ) {
+    for ( size_t i = 0; i < n_pages_; i++ ) {
       head->addr = &a[( rand() % page_range )][128];
       head->next = &addr[( rand() % page_range )];
       head = head->next;
     }
 
+    // record the working set of the pointer chase
+    head = &addr[0];
+    for ( size_t i = 0; i < n_pages_; i++ ) {
+      hot_set_.push_back( head );
+      hot_set_.push_back( head->addr );
+      head = head->next;
+    }
+
     matrix1->Random();
     matrix2->Random();
     matrix3->Random();
@@ -61,7 +79,7 @@ public:
   {
     volatile int tmp;
     struct node* head = &addr[0];
-    for ( int j = 0; j < n_pages; j++ ) {
+    for ( size_t j = 0; j < n_pages_; j++ ) {
       tmp = *( head->addr );
       head = head->next;
     }
@@ -70,12 +88,17 @@ public:
 
     return tmp;
   }
+
+  // after a syscall, bring the pointer chase's working set back into the cache
+  void rewarm() { prefetch_hot_set( hot_set_ ); }
 };
 
 void usage_error( span<char*> args )
 {
   cerr << "Usage: " << args[0]
-       << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\"] random_seed\n";
+       << " total_iterations when_sycall [=\"at_end\" or \"interspersed\" or \"never\" or \"coalesced\" or"
+          " \"adaptive\"] random_seed"
+          " [rewarm=\"none\" or \"prefetch\"] [instructions=N]\n";
   throw runtime_error( "invalid usage" );
 }
 
@@ -88,12 +111,13 @@ int main( int argc, char* argv[] )
     abort();
   }
   auto args = span( argv, argc );
-  if ( args.size() != 4 ) {
+  if ( args.size() < 4 || args.size() > 6 ) {
     usage_error( args );
   }
   auto total_iterations = to_uint64( args[1] );
   auto when = args[2];
   bool syscalls_at_end, syscalls_interspersed;
+  bool syscalls_coalesced = false;
 
   if ( when == "at_end"sv ) {
     syscalls_at_end = true;
@@ -104,33 +128,110 @@ int main( int argc, char* argv[] )
   } else if ( when == "never"sv ) {
     syscalls_at_end = false;
     syscalls_interspersed = false;
+  } else if ( when == "coalesced"sv || when == "adaptive"sv ) {
+    syscalls_at_end = false;
+    syscalls_interspersed = false;
+    syscalls_coalesced = true;
   } else {
     usage_error( args );
   }
 
   unsigned int random_seed = to_uint64( args[3] );
 
+  // Optional arguments, in any order:
+  //   the rewarm argument (either value), which also times the user code with read_tsc(), to compare the
+  //     fraction of the syscall's indirect cost recovered (without it, the loop is left untimed as before)
+  //   instructions=N, which calibrates the workload size to N instructions per iteration
+  bool rewarm_after_syscall = false;
+  bool time_user_code = false;
+  uint64_t target_instructions = 0;
+  for ( const string_view option : args.subspan( 4 ) ) {
+    if ( option == "prefetch"sv || option == "none"sv ) {
+      rewarm_after_syscall = option == "prefetch"sv;
+      time_user_code = true;
+    } else if ( option.starts_with( "instructions="sv ) ) {
+      target_instructions = to_uint64( option.substr( "instructions="sv.size() ) );
+    } else {
+      usage_error( args );
+    }
+  }
+
   // Open dummy file
   int fd = memfd_create( "dummy", 0 );
   if ( fd < 0 ) {
     throw runtime_error( "memfd_create" );
   }
 
+  // Size the compute "workload": by default the fixed page count, or calibrated to hit
+  // a requested number of instructions per iteration
+  size_t n_pages = default_n_pages;
+  if ( target_instructions ) {
+    const auto calibration = calibrate_workload_size(
+      target_instructions,
+      { default_n_pages / 2, default_n_pages, default_n_pages * 2 },
+      [&]( size_t size ) { return Workload { random_seed, size }; },
+      []( Workload& w ) { w.do_computation(); } );
+    n_pages = calibration.size;
+    cerr << "Calibrated page count: " << n_pages << " (" << calibration.instructions_per_iteration
+         << " instructions per iteration)\n";
+  }
+
   // Initialize compute "workload"
-  Workload workload { random_seed };
+  Workload workload { random_seed, n_pages };
+
+  // For the coalesced modes, the interspersed writes go through a user-space buffer that is flushed with one
+  // pwritev per batch: of 16 writes ("coalesced"), or of a size adapted to the measured flush cost ("adaptive").
+  // Either way, a batch is flushed once its oldest write is 1 ms old.
+  // Only the adaptive policy looks at the work's duration, so only it pays for timing each iteration.
+  const bool adaptive = when == "adaptive"sv;
+  unique_ptr<CoalescingWriter> writer;
+  if ( syscalls_coalesced ) {
+    const CoalescingWriter::Policy policy {
+      64 * 1024, 16, uint64_t( estimate_tsc_ticks_per_second() / 1000 ), adaptive, 0.01 };
+    writer = make_unique<CoalescingWriter>( fd, 0, policy );
+  }
 
   uint64_t syscall_count = 0;
+  const auto run_beginning = chrono::steady_clock::now();
+  uint64_t total_tsc_in_user_code = 0;
 
-  // In each iteration, do computation and record the TSC before and after.
-  // Also, sometimes do a syscall at user-controlled interval (outside the pair of TSC samples).
+  // In each iteration, do computation (optionally recording the TSC before and after).
+  // Also, sometimes do a syscall at user-controlled interval (outside the pair of TSC samples),
+  // optionally followed by a rewarm of the workload's hot set (timed, so its cost is counted as user code).
   for ( size_t i = 0; i < total_iterations; ++i ) {
-    workload.do_computation();
+    uint64_t work_ticks = 0;
+    if ( time_user_code ) {
+      const auto user_code_beginning = read_tsc();
+      workload.do_computation();
+      work_ticks = read_tsc() - user_code_beginning;
+      total_tsc_in_user_code += work_ticks;
+    } else if ( adaptive ) {
+      // the adaptive policy needs the work's duration (unfenced, as in ipcfun4, to keep the timing cheap)
+      const auto work_beginning = __rdtsc();
+      workload.do_computation();
+      work_ticks = __rdtsc() - work_beginning;
+    } else {
+      workload.do_computation();
+    }
+
+    if ( syscalls_coalesced ) {
+      if ( adaptive ) {
+        writer->note_work( work_ticks );
+      }
+      writer->write( {} );
+    }
 
     if ( syscalls_interspersed ) {
       if ( 0 != pwrite( fd, nullptr, 0, 0 ) ) {
         throw runtime_error( "pwrite returned error" );
       }
       ++syscall_count;
+
+      if ( rewarm_after_syscall ) {
+        const auto rewarm_beginning = read_tsc();
+        workload.rewarm();
+        total_tsc_in_user_code += read_tsc() - rewarm_beginning;
+      }
     }
   }
 
@@ -143,10 +244,48 @@ int main( int argc, char* argv[] )
     }
   }
 
+  if ( syscalls_coalesced ) {
+    writer->flush();
+    syscall_count += writer->flush_count();
+  }
+
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - run_beginning;
+
   cerr << "Iterations: " << total_iterations << "\n";
   cerr << "Syscall count: " << syscall_count << "\n";
   cerr << "Syscalls interspersed: " << syscalls_interspersed << "\n";
   cerr << "Syscalls all at the end: " << syscalls_at_end << "\n";
+  if ( syscalls_coalesced ) {
+    cerr << "Writes coalesced: " << writer->write_count() << "\n";
+    cerr << "Final write-count threshold: " << writer->max_writes() << "\n";
+    cerr << "Average write latency (TSC ticks): " << writer->average_latency_tsc() << "\n";
+    cerr << "Maximum write latency (TSC ticks): " << writer->max_latency_tsc() << "\n";
+  }
+  cerr << "Rewarm after syscall: " << rewarm_after_syscall << "\n";
+
+  // The fraction of the syscall's indirect cost recovered by rewarming is
+  //   (interspersed - interspersed_with_prefetch) / (interspersed - never)
+  // computed from this value across three runs with the same seed.
+  if ( time_user_code ) {
+    cerr << "Total TSC ticks in user code: " << total_tsc_in_user_code << "\n";
+  }
+  cerr << "Elapsed seconds: " << elapsed.count() << "\n";
+
+  ResultsRecord record { "ipcfun6" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "when", when );
+  record.add_config( "random_seed", random_seed );
+  record.add_config( "n_pages", n_pages );
+  if ( time_user_code ) {
+    record.add_config( "rewarm", rewarm_after_syscall ? "prefetch" : "none" );
+    record.add_lower_is_better( "tsc_in_user_code", total_tsc_in_user_code );
+  }
+  if ( syscalls_coalesced ) {
+    record.add_lower_is_better( "syscall_count", syscall_count );
+    record.add_lower_is_better( "average_write_latency_tsc", writer->average_latency_tsc() );
+  }
+  record.add_higher_is_better( "iterations_per_second", double( total_iterations ) / elapsed.count() );
+  record.append_to_results_file();
 
   return EXIT_SUCCESS;
 }
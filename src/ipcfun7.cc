@@ -0,0 +1,305 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "calibration.hh"
+#include "results.hh"
+#include "support.hh"
+
+using namespace std;
+
+class Workload
+{
+  using T1 = Eigen::Matrix<float, 8, 8>;
+  using T2 = Eigen::Matrix<float, 8, 5>;
+  using T3 = Eigen::Matrix<float, 8, 5>;
+
+  // Numerical computation: matrix multiplication
+  unique_ptr<T1> matrix1 { make_unique<T1>() };
+  unique_ptr<T2> matrix2 { make_unique<T2>() };
+  unique_ptr<T3> matrix3 { make_unique<T3>() };
+
+  size_t repetitions_; // matrix multiplications per iteration
+
+public:
+  explicit Workload( size_t repetitions )
+    : repetitions_( repetitions )
+  {
+    matrix1->Random();
+    matrix2->Random();
+    matrix3->Random();
+  }
+
+  void do_matrix_computation()
+  {
+    if ( repetitions_ == 1 ) { // the original, uncalibrated body
+      *matrix3 = *matrix1 * *matrix2;
+      return;
+    }
+
+    for ( size_t i = 0; i < repetitions_; ++i ) {
+      *matrix3 = *matrix1 * *matrix2;
+      asm volatile( "" : : "r"( matrix3->data() ) : "memory" ); // keep each repetition
+    }
+  }
+};
+
+enum class WriteMethod
+{
+  None,     // no write at all (baseline for downstream IPC)
+  Pwrite,   // one copying pwrite of the whole payload
+  Pwritev,  // one copying pwritev, payload split into page-sized iovecs
+  Vmsplice, // vmsplice the user pages into a pipe, then splice the pipe into the memfd
+  Mmap      // store into a shared mapping of the memfd (no system call)
+};
+
+// Writes a payload to offset 0 of a memfd, using one of several copying or zero-copy paths
+class PayloadWriter
+{
+  static constexpr size_t page_size = 4096;
+
+  WriteMethod method_;
+  size_t max_payload_size_;
+  int fd_;
+  int pipe_read_fd_ { -1 }, pipe_write_fd_ { -1 };
+  char* mapping_ { nullptr };
+  vector<iovec> iovecs_ {};
+
+public:
+  PayloadWriter( WriteMethod method, size_t max_payload_size )
+    : method_( method ), max_payload_size_( max_payload_size ), fd_( memfd_create( "dummy", 0 ) )
+  {
+    if ( fd_ < 0 ) {
+      throw runtime_error( "memfd_create" );
+    }
+
+    // size the file up front so no write extends it
+    CheckSystemCall( "ftruncate", ftruncate( fd_, max_payload_size_ ) );
+
+    if ( method_ == WriteMethod::Vmsplice ) {
+      int pipe_fds[2];
+      CheckSystemCall( "pipe", pipe( pipe_fds ) );
+      pipe_read_fd_ = pipe_fds[0];
+      pipe_write_fd_ = pipe_fds[1];
+
+      // try to fit a whole payload in the pipe (fine if this fails; write() will loop)
+      fcntl( pipe_write_fd_, F_SETPIPE_SZ, max_payload_size_ );
+    }
+
+    if ( method_ == WriteMethod::Mmap ) {
+      void* mapping = mmap( nullptr, max_payload_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0 );
+      if ( mapping == MAP_FAILED ) {
+        throw tagged_error( system_category(), "mmap", errno );
+      }
+      mapping_ = static_cast<char*>( mapping );
+    }
+  }
+
+  void write( span<char> payload )
+  {
+    switch ( method_ ) {
+      case WriteMethod::None:
+        break;
+
+      case WriteMethod::Pwrite:
+        if ( ssize_t( payload.size() )
+             != CheckSystemCall( "pwrite", pwrite( fd_, payload.data(), payload.size(), 0 ) ) ) {
+          throw runtime_error( "short write" );
+        }
+        break;
+
+      case WriteMethod::Pwritev: {
+        // page-sized iovecs, grown (in whole pages) for payloads that would otherwise need more than IOV_MAX
+        const size_t page_sized_iovecs_capacity = page_size * IOV_MAX;
+        const size_t pages_per_iovec
+          = max<size_t>( 1, ( payload.size() + page_sized_iovecs_capacity - 1 ) / page_sized_iovecs_capacity );
+        const size_t iovec_size = pages_per_iovec * page_size;
+        iovecs_.clear();
+        for ( size_t offset = 0; offset < payload.size(); offset += iovec_size ) {
+          iovecs_.push_back( { payload.data() + offset, min( iovec_size, payload.size() - offset ) } );
+        }
+        if ( ssize_t( payload.size() )
+             != CheckSystemCall( "pwritev", pwritev( fd_, iovecs_.data(), iovecs_.size(), 0 ) ) ) {
+          throw runtime_error( "short write" );
+        }
+      } break;
+
+      case WriteMethod::Vmsplice: {
+        // The pipe only references the user pages; the splice into the memfd is the single copy,
+        // and it completes before we return, so reusing the buffer afterwards is safe.
+        loff_t file_offset = 0;
+        size_t done = 0;
+        while ( done < payload.size() ) {
+          iovec iov { payload.data() + done, payload.size() - done };
+          const auto in_pipe = CheckSystemCall( "vmsplice", vmsplice( pipe_write_fd_, &iov, 1, 0 ) );
+          for ( ssize_t drained = 0; drained < in_pipe; ) {
+            drained += CheckSystemCall(
+              "splice", splice( pipe_read_fd_, nullptr, fd_, &file_offset, in_pipe - drained, SPLICE_F_MOVE ) );
+          }
+          done += in_pipe;
+        }
+      } break;
+
+      case WriteMethod::Mmap:
+        memcpy( mapping_, payload.data(), payload.size() );
+        break;
+    }
+  }
+
+  ~PayloadWriter()
+  {
+    if ( mapping_ ) {
+      munmap( mapping_, max_payload_size_ );
+    }
+    if ( pipe_read_fd_ >= 0 ) {
+      close( pipe_read_fd_ );
+      close( pipe_write_fd_ );
+    }
+    close( fd_ );
+  }
+
+  PayloadWriter( const PayloadWriter& ) = delete;
+  PayloadWriter& operator=( const PayloadWriter& ) = delete;
+};
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0]
+       << " total_iterations write_method [=\"none\" or \"pwrite\" or \"pwritev\" or \"vmsplice\" or \"mmap\"]"
+          " [min_payload_size max_payload_size] [instructions_per_iteration]\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() < 3 || args.size() > 6 ) {
+    usage_error( args );
+  }
+  auto total_iterations = to_uint64( args[1] );
+  auto method_name = args[2];
+  WriteMethod method;
+
+  if ( method_name == "none"sv ) {
+    method = WriteMethod::None;
+  } else if ( method_name == "pwrite"sv ) {
+    method = WriteMethod::Pwrite;
+  } else if ( method_name == "pwritev"sv ) {
+    method = WriteMethod::Pwritev;
+  } else if ( method_name == "vmsplice"sv ) {
+    method = WriteMethod::Vmsplice;
+  } else if ( method_name == "mmap"sv ) {
+    method = WriteMethod::Mmap;
+  } else {
+    usage_error( args );
+  }
+
+  uint64_t min_payload_size = 64;
+  uint64_t max_payload_size = 1024 * 1024;
+  if ( args.size() >= 5 ) {
+    min_payload_size = to_uint64( args[3] );
+    max_payload_size = to_uint64( args[4] );
+  }
+  if ( min_payload_size == 0 || min_payload_size > max_payload_size ) {
+    usage_error( args );
+  }
+
+  // Prevent CPU migration
+  lock_to_CPU_zero();
+
+  const double tsc_ticks_per_second = estimate_tsc_ticks_per_second();
+
+  // Size the compute "workload": by default one multiplication per iteration, or calibrated to hit
+  // a requested number of instructions per iteration
+  size_t repetitions = 1;
+  if ( args.size() == 4 || args.size() == 6 ) {
+    const auto calibration = calibrate_workload_size(
+      to_uint64( args.back() ),
+      { 1, 2, 4 },
+      []( size_t size ) { return Workload { size }; },
+      []( Workload& w ) { w.do_matrix_computation(); } );
+    repetitions = calibration.size;
+    cerr << "Calibrated repetitions: " << repetitions << " (" << calibration.instructions_per_iteration
+         << " instructions per iteration)\n";
+  }
+
+  // Initialize compute "workload", payload and writer
+  Workload workload { repetitions };
+  vector<char> payload( max_payload_size, 'x' );
+  PayloadWriter writer { method, max_payload_size };
+
+  // Initialize monitoring of IPC (instructions per cycle)
+  IPCCounter perf;
+  perf.start();
+
+  cout << "# Write method: " << method_name << "\n";
+  cout << "# TSC ticks per second: " << tsc_ticks_per_second << "\n";
+  cout << "# payload_size write_throughput_bytes_per_second downstream_user_ipc\n";
+
+  // Sweep payload sizes in powers of two. In each iteration, do computation (measuring its user IPC),
+  // then write the payload (measuring its TSC ticks, outside the pair of counter readings).
+  for ( uint64_t payload_size = min_payload_size; payload_size <= max_payload_size; payload_size *= 2 ) {
+    const auto payload_span = span( payload ).first( payload_size );
+
+    long long user_instructions = 0, user_cycles = 0;
+    uint64_t write_tsc_ticks = 0;
+
+    for ( size_t i = 0; i < total_iterations; ++i ) {
+      const auto pre = perf.read();
+      workload.do_matrix_computation();
+      const auto post = perf.read();
+
+      user_instructions += post.instructions - pre.instructions;
+      user_cycles += post.cycles - pre.cycles;
+
+      const auto write_beginning = read_tsc();
+      writer.write( payload_span );
+      write_tsc_ticks += read_tsc() - write_beginning;
+    }
+
+    const double bytes_written = double( payload_size ) * double( total_iterations );
+    const double write_seconds = double( write_tsc_ticks ) / tsc_ticks_per_second;
+    const double downstream_user_ipc = double( user_instructions ) / double( user_cycles );
+
+    // ("none" writes nothing, so it has no throughput, only the downstream IPC baseline)
+    const bool wrote = method != WriteMethod::None;
+    cout << payload_size << " ";
+    if ( wrote ) {
+      cout << bytes_written / write_seconds;
+    } else {
+      cout << "-";
+    }
+    cout << " " << downstream_user_ipc << "\n";
+
+    ResultsRecord record { "ipcfun7" };
+    record.add_config( "total_iterations", total_iterations );
+    record.add_config( "write_method", method_name );
+    record.add_config( "payload_size", payload_size );
+    record.add_config( "repetitions", repetitions );
+    record.add_calibration( "tsc_ticks_per_second", tsc_ticks_per_second );
+    if ( wrote ) {
+      record.add_higher_is_better( "write_throughput_bytes_per_second", bytes_written / write_seconds );
+    }
+    record.add_higher_is_better( "downstream_user_ipc", downstream_user_ipc );
+    record.append_to_results_file();
+  }
+
+  return EXIT_SUCCESS;
+}
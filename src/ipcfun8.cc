@@ -0,0 +1,326 @@
+#include <linux/aio_abi.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "calibration.hh"
+#include "results.hh"
+#include "support.hh"
+
+using namespace std;
+
+class Workload
+{
+  using T1 = Eigen::Matrix<float, 8, 8>;
+  using T2 = Eigen::Matrix<float, 8, 5>;
+  using T3 = Eigen::Matrix<float, 8, 5>;
+
+  // Numerical computation: matrix multiplication
+  unique_ptr<T1> matrix1 { make_unique<T1>() };
+  unique_ptr<T2> matrix2 { make_unique<T2>() };
+  unique_ptr<T3> matrix3 { make_unique<T3>() };
+
+  size_t repetitions_; // matrix multiplications per iteration
+
+public:
+  explicit Workload( size_t repetitions )
+    : repetitions_( repetitions )
+  {
+    matrix1->Random();
+    matrix2->Random();
+    matrix3->Random();
+  }
+
+  void do_matrix_computation()
+  {
+    if ( repetitions_ == 1 ) { // the original, uncalibrated body
+      *matrix3 = *matrix1 * *matrix2;
+      return;
+    }
+
+    for ( size_t i = 0; i < repetitions_; ++i ) {
+      *matrix3 = *matrix1 * *matrix2;
+      asm volatile( "" : : "r"( matrix3->data() ) : "memory" ); // keep each repetition
+    }
+  }
+};
+
+// Minimal coroutine type: starts suspended, and is resumed only by the Scheduler
+class Task
+{
+public:
+  struct promise_type
+  {
+    Task get_return_object() { return Task { coroutine_handle<promise_type>::from_promise( *this ) }; }
+    suspend_always initial_suspend() noexcept { return {}; }
+    suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { throw; }
+  };
+
+  explicit Task( coroutine_handle<promise_type> handle ) : handle_( handle ) {}
+  Task( Task&& other ) noexcept : handle_( exchange( other.handle_, {} ) ) {}
+  Task( const Task& ) = delete;
+  Task& operator=( const Task& ) = delete;
+  Task& operator=( Task&& ) = delete;
+
+  ~Task()
+  {
+    if ( handle_ ) {
+      handle_.destroy();
+    }
+  }
+
+  coroutine_handle<> handle() const { return handle_; }
+
+private:
+  coroutine_handle<promise_type> handle_;
+};
+
+// Asynchronous pwrite backend using the kernel AIO interface (io_submit/io_getevents).
+// Writes are queued in user space and handed to the kernel in one batch, and completions
+// are harvested in one batch.
+class AIOBackend
+{
+  aio_context_t context_ {};
+  vector<iocb> iocbs_;
+  vector<iocb*> pending_ {};
+  vector<io_event> events_;
+
+  uint64_t syscall_count_ {};
+  uint64_t write_count_ {};
+
+public:
+  explicit AIOBackend( size_t max_in_flight ) : iocbs_( max_in_flight ), events_( max_in_flight )
+  {
+    CheckSystemCall( "io_setup", syscall( SYS_io_setup, max_in_flight, &context_ ) );
+    pending_.reserve( max_in_flight );
+  }
+
+  ~AIOBackend() { syscall( SYS_io_destroy, context_ ); }
+
+  AIOBackend( const AIOBackend& ) = delete;
+  AIOBackend& operator=( const AIOBackend& ) = delete;
+
+  bool has_pending() const { return !pending_.empty(); }
+
+  void queue_pwrite( int fd, const void* buf, size_t count, off_t offset, void* user_data )
+  {
+    if ( pending_.size() == iocbs_.size() ) {
+      throw runtime_error( "too many writes in flight" );
+    }
+
+    iocb& cb = iocbs_.at( pending_.size() );
+    cb = {};
+    cb.aio_data = reinterpret_cast<uint64_t>( user_data );
+    cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+    cb.aio_fildes = fd;
+    cb.aio_buf = reinterpret_cast<uint64_t>( buf );
+    cb.aio_nbytes = count;
+    cb.aio_offset = offset;
+    pending_.push_back( &cb );
+  }
+
+  // submit every queued write, wait for all of them to complete, and return the completions
+  span<const io_event> submit_and_harvest()
+  {
+    const long submitted
+      = CheckSystemCall( "io_submit", syscall( SYS_io_submit, context_, pending_.size(), pending_.data() ) );
+    ++syscall_count_;
+    if ( size_t( submitted ) != pending_.size() ) {
+      throw runtime_error( "io_submit accepted only part of the batch" );
+    }
+    pending_.clear();
+
+    long harvested = 0;
+    while ( harvested < submitted ) {
+      harvested += CheckSystemCall( "io_getevents",
+                                    syscall( SYS_io_getevents,
+                                             context_,
+                                             submitted - harvested,
+                                             submitted - harvested,
+                                             events_.data() + harvested,
+                                             nullptr ) );
+      ++syscall_count_;
+    }
+
+    write_count_ += harvested;
+    return span( events_ ).first( harvested );
+  }
+
+  uint64_t syscall_count() const { return syscall_count_; }
+  uint64_t write_count() const { return write_count_; }
+};
+
+// Runs Tasks on the current thread. When every task is suspended on a write,
+// the writes are submitted as one batch and the tasks whose writes completed are resumed.
+class Scheduler
+{
+  AIOBackend backend_;
+  deque<coroutine_handle<>> runnable_ {};
+
+public:
+  explicit Scheduler( size_t max_in_flight ) : backend_( max_in_flight ) {}
+
+  struct PwriteAwaitable
+  {
+    Scheduler& scheduler;
+    int fd;
+    const void* buf;
+    size_t count;
+    off_t offset;
+
+    coroutine_handle<> waiter {};
+    long long result {};
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend( coroutine_handle<> handle )
+    {
+      waiter = handle;
+      scheduler.backend_.queue_pwrite( fd, buf, count, offset, this );
+    }
+
+    long long await_resume() const
+    {
+      if ( result < 0 ) {
+        throw tagged_error( system_category(), "async pwrite", int( -result ) );
+      }
+      return result;
+    }
+  };
+
+  PwriteAwaitable pwrite( int fd, const void* buf, size_t count, off_t offset )
+  {
+    return { *this, fd, buf, count, offset };
+  }
+
+  void run( span<Task> tasks )
+  {
+    for ( const auto& task : tasks ) {
+      runnable_.push_back( task.handle() );
+    }
+
+    while ( !runnable_.empty() ) {
+      // run every runnable task until it suspends on a write (or finishes)
+      while ( !runnable_.empty() ) {
+        const auto handle = runnable_.front();
+        runnable_.pop_front();
+        handle.resume();
+      }
+
+      // then hand the batch of writes to the kernel and resume the tasks whose writes completed
+      if ( backend_.has_pending() ) {
+        for ( const auto& event : backend_.submit_and_harvest() ) {
+          auto* awaitable = reinterpret_cast<PwriteAwaitable*>( event.data );
+          awaitable->result = event.res;
+          runnable_.push_back( awaitable->waiter );
+        }
+      }
+    }
+  }
+
+  const AIOBackend& backend() const { return backend_; }
+};
+
+Task computation_task( Scheduler& scheduler, Workload& workload, int fd, uint64_t iterations )
+{
+  for ( uint64_t i = 0; i < iterations; ++i ) {
+    workload.do_matrix_computation();
+
+    if ( 0 != co_await scheduler.pwrite( fd, nullptr, 0, 0 ) ) {
+      throw runtime_error( "pwrite returned error" );
+    }
+  }
+}
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0] << " total_iterations task_count [instructions_per_iteration]\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() != 3 && args.size() != 4 ) {
+    usage_error( args );
+  }
+  auto total_iterations = to_uint64( args[1] );
+  auto task_count = to_uint64( args[2] );
+  if ( task_count == 0 ) {
+    usage_error( args );
+  }
+
+  // Open dummy file
+  int fd = memfd_create( "dummy", 0 );
+  if ( fd < 0 ) {
+    throw runtime_error( "memfd_create" );
+  }
+
+  // Prevent CPU migration
+  lock_to_CPU_zero();
+
+  // Size the compute "workload": by default one multiplication per iteration, or calibrated to hit
+  // a requested number of instructions per iteration
+  size_t repetitions = 1;
+  if ( args.size() == 4 ) {
+    const auto calibration = calibrate_workload_size(
+      to_uint64( args.back() ),
+      { 1, 2, 4 },
+      []( size_t size ) { return Workload { size }; },
+      []( Workload& w ) { w.do_matrix_computation(); } );
+    repetitions = calibration.size;
+    cerr << "Calibrated repetitions: " << repetitions << " (" << calibration.instructions_per_iteration
+         << " instructions per iteration)\n";
+  }
+
+  // Initialize compute "workload"
+  Workload workload { repetitions };
+
+  // Split the iterations across the tasks. Each task does computation, then awaits a pwrite.
+  // All tasks are multiplexed onto this thread, so up to task_count writes are batched together.
+  Scheduler scheduler { task_count };
+  vector<Task> tasks;
+  tasks.reserve( task_count );
+  for ( uint64_t i = 0; i < task_count; ++i ) {
+    const uint64_t iterations = total_iterations / task_count + ( i < total_iterations % task_count ? 1 : 0 );
+    tasks.push_back( computation_task( scheduler, workload, fd, iterations ) );
+  }
+
+  const auto run_beginning = chrono::steady_clock::now();
+  scheduler.run( tasks );
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - run_beginning;
+
+  cerr << "Iterations: " << total_iterations << "\n";
+  cerr << "Tasks: " << task_count << "\n";
+  cerr << "Writes completed: " << scheduler.backend().write_count() << "\n";
+  cerr << "Syscall count: " << scheduler.backend().syscall_count() << "\n";
+  cerr << "Elapsed seconds: " << elapsed.count() << "\n";
+
+  ResultsRecord record { "ipcfun8" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "task_count", task_count );
+  record.add_config( "repetitions", repetitions );
+  record.add_lower_is_better( "syscall_count", scheduler.backend().syscall_count() );
+  record.add_higher_is_better( "iterations_per_second", double( total_iterations ) / elapsed.count() );
+  record.append_to_results_file();
+
+  return EXIT_SUCCESS;
+}
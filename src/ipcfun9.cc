@@ -0,0 +1,237 @@
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "results.hh"
+#include "support.hh"
+
+using namespace std;
+
+constexpr size_t recovery_window = 200; // iterations after each kernel entry that make up the recovery curve
+
+struct Sample
+{
+  IPCCounter::Reading pre, post;
+  bool kernel_entry; // a pwrite, or a signal delivered during this iteration
+};
+
+class Workload
+{
+  using T1 = Eigen::Matrix<float, 8, 8>;
+  using T2 = Eigen::Matrix<float, 8, 5>;
+  using T3 = Eigen::Matrix<float, 8, 5>;
+
+  // Numerical computation: matrix multiplication
+  unique_ptr<T1> matrix1 { make_unique<T1>() };
+  unique_ptr<T2> matrix2 { make_unique<T2>() };
+  unique_ptr<T3> matrix3 { make_unique<T3>() };
+
+public:
+  Workload()
+  {
+    matrix1->Random();
+    matrix2->Random();
+    matrix3->Random();
+  }
+
+  void do_matrix_computation() { *matrix3 = *matrix1 * *matrix2; }
+};
+
+// State shared with the signal handler
+volatile sig_atomic_t signals_delivered = 0;
+vector<char> handler_scratch {}; // the handler touches every cache line of this (empty = empty handler)
+
+void handle_signal( int )
+{
+  for ( size_t i = 0; i < handler_scratch.size(); i += 64 ) {
+    handler_scratch[i] = handler_scratch[i] + 1;
+  }
+  signals_delivered = signals_delivered + 1;
+}
+
+// Periodically delivers a signal to the calling thread via a POSIX timer
+class SignalInjector
+{
+  timer_t timer_ {};
+
+public:
+  SignalInjector( int signal_number, uint64_t interval_us )
+  {
+    struct sigaction action
+    {};
+    action.sa_handler = handle_signal;
+    sigemptyset( &action.sa_mask );
+    CheckSystemCall( "sigaction", sigaction( signal_number, &action, nullptr ) );
+
+    sigevent event {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = signal_number;
+    event._sigev_un._tid = gettid();
+    CheckSystemCall( "timer_create", timer_create( CLOCK_MONOTONIC, &event, &timer_ ) );
+
+    const timespec interval { time_t( interval_us / 1000000 ), long( interval_us % 1000000 ) * 1000 };
+    const itimerspec schedule { interval, interval };
+    CheckSystemCall( "timer_settime", timer_settime( timer_, 0, &schedule, nullptr ) );
+  }
+
+  ~SignalInjector() { timer_delete( timer_ ); }
+
+  SignalInjector( const SignalInjector& ) = delete;
+  SignalInjector& operator=( const SignalInjector& ) = delete;
+};
+
+void usage_error( span<char*> args )
+{
+  cerr << "Usage: " << args[0]
+       << " total_iterations source [=\"pwrite\" or \"sigalrm\" or \"sigrt\"] interval_us handler_bytes\n";
+  throw runtime_error( "invalid usage" );
+}
+
+int main( int argc, char* argv[] )
+{
+  ios::sync_with_stdio( false );
+
+  // Parse arguments
+  if ( argc <= 0 ) {
+    abort();
+  }
+  auto args = span( argv, argc );
+  if ( args.size() != 5 ) {
+    usage_error( args );
+  }
+  auto total_iterations = to_uint64( args[1] );
+  auto source = args[2];
+  auto interval_us = to_uint64( args[3] );
+  auto handler_bytes = to_uint64( args[4] );
+  if ( interval_us == 0 ) {
+    usage_error( args );
+  }
+
+  bool synchronous;
+  int signal_number = 0;
+  if ( source == "pwrite"sv ) {
+    synchronous = true;
+  } else if ( source == "sigalrm"sv ) {
+    synchronous = false;
+    signal_number = SIGALRM;
+  } else if ( source == "sigrt"sv ) {
+    synchronous = false;
+    signal_number = SIGRTMIN;
+  } else {
+    usage_error( args );
+  }
+
+  // Open dummy file
+  int fd = memfd_create( "dummy", 0 );
+  if ( fd < 0 ) {
+    throw runtime_error( "memfd_create" );
+  }
+
+  // Prevent CPU migration
+  lock_to_CPU_zero();
+
+  // For the synchronous case, issue a pwrite whenever this many TSC ticks have elapsed
+  const double tsc_ticks_per_second = estimate_tsc_ticks_per_second();
+  const uint64_t tsc_ticks_per_interval = tsc_ticks_per_second * double( interval_us ) / 1.0e6;
+
+  // Initialize compute "workload" and the handler's working set
+  Workload workload;
+  handler_scratch.resize( handler_bytes );
+
+  // Initialize monitoring of IPC (instructions per cycle)
+  IPCCounter perf;
+  vector<Sample> samples( total_iterations );
+
+  unique_ptr<SignalInjector> injector;
+  if ( !synchronous ) {
+    injector = make_unique<SignalInjector>( signal_number, interval_us );
+  }
+
+  perf.start();
+
+  uint64_t next_pwrite_tsc = read_tsc() + tsc_ticks_per_interval;
+
+  // In each iteration, either do a pwrite (if its deadline has passed) or do computation.
+  // A signal may arrive at any point; the iteration it lands in is marked as the kernel entry.
+  for ( size_t i = 0; i < total_iterations; ++i ) {
+    auto& sample = samples.at( i );
+    const auto signals_before = signals_delivered;
+
+    // (check the deadline outside the measured interval, so every source measures the same iteration body)
+    const bool pwrite_due = synchronous && read_tsc() >= next_pwrite_tsc;
+    sample.pre = perf.read();
+
+    if ( pwrite_due ) {
+      if ( 1 != CheckSystemCall( "pwrite", pwrite( fd, "x", 1, 0 ) ) ) {
+        throw runtime_error( "short write" );
+      }
+      next_pwrite_tsc += tsc_ticks_per_interval;
+      sample.kernel_entry = true;
+    } else {
+      workload.do_matrix_computation();
+    }
+
+    sample.post = perf.read();
+    if ( signals_delivered != signals_before ) {
+      sample.kernel_entry = true;
+    }
+  }
+
+  injector.reset();
+
+  // Average the IPC of each iteration by its distance from the most recent kernel entry.
+  // Iterations further than recovery_window from any kernel entry count as steady state.
+  vector<long long> instructions_by_distance( recovery_window + 1 ), cycles_by_distance( recovery_window + 1 );
+  vector<uint64_t> count_by_distance( recovery_window + 1 );
+  uint64_t kernel_entries = 0;
+  size_t distance = recovery_window;
+
+  for ( const auto& sample : samples ) {
+    if ( sample.kernel_entry ) {
+      ++kernel_entries;
+      distance = 0;
+      continue;
+    }
+
+    distance = min( distance + 1, recovery_window );
+    instructions_by_distance.at( distance ) += sample.post.instructions - sample.pre.instructions;
+    cycles_by_distance.at( distance ) += sample.post.cycles - sample.pre.cycles;
+    ++count_by_distance.at( distance );
+  }
+
+  const double steady_state_ipc = double( instructions_by_distance.back() ) / double( cycles_by_distance.back() );
+  const double first_iteration_ipc
+    = double( instructions_by_distance.at( 1 ) ) / double( cycles_by_distance.at( 1 ) );
+
+  cout << "# Source: " << source << ", interval: " << interval_us << " us, handler bytes: " << handler_bytes
+       << "\n";
+  cout << "# Iterations: " << total_iterations << ", kernel entries: " << kernel_entries
+       << ", signals delivered: " << signals_delivered << "\n";
+  cout << "# Steady-state IPC (more than " << recovery_window << " iterations after a kernel entry): "
+       << steady_state_ipc << "\n";
+  cout << "# iterations_since_kernel_entry average_ipc sample_count\n";
+  for ( size_t k = 1; k < recovery_window; ++k ) {
+    cout << k << " " << double( instructions_by_distance.at( k ) ) / double( cycles_by_distance.at( k ) ) << " "
+         << count_by_distance.at( k ) << "\n";
+  }
+
+  ResultsRecord record { "ipcfun9" };
+  record.add_config( "total_iterations", total_iterations );
+  record.add_config( "source", source );
+  record.add_config( "interval_us", interval_us );
+  record.add_config( "handler_bytes", handler_bytes );
+  record.add_calibration( "tsc_ticks_per_second", tsc_ticks_per_second );
+  record.add_higher_is_better( "steady_state_ipc", steady_state_ipc );
+  record.add_higher_is_better( "first_iteration_ipc", first_iteration_ipc );
+  record.append_to_results_file();
+
+  return EXIT_SUCCESS;
+}
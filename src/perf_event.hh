@@ -0,0 +1,214 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "support.hh"
+
+inline int perf_event_open( perf_event_attr& attr, int group_fd )
+{
+  // measure the calling thread, on any CPU
+  return CheckSystemCall( "perf_event_open", syscall( SYS_perf_event_open, &attr, 0, -1, group_fd, 0 ) );
+}
+
+// Counts user-space instructions and cycles, and writes a (time, instructions, cycles) record into
+// a ring buffer shared with the kernel every time the instruction count crosses a multiple of the
+// sample period. Nothing runs in the measured code between overflows.
+class PerfSampler
+{
+public:
+  struct Sample
+  {
+    uint64_t tsc;
+    uint64_t instructions;
+    uint64_t cycles;
+  };
+
+private:
+  static constexpr size_t ring_pages = 1024; // data pages (must be a power of two)
+
+  int leader_fd_ {}, cycles_fd_ {};
+  size_t page_size_;
+  size_t mapping_size_;
+  perf_event_mmap_page* metadata_ { nullptr };
+
+  std::vector<Sample> samples_ {};
+  uint64_t lost_records_ {};
+
+  // invert the kernel's TSC -> perf clock conversion (see perf_event_mmap_page::time_zero)
+  uint64_t perf_time_to_tsc( uint64_t time ) const
+  {
+    const uint64_t delta = time - metadata_->time_zero;
+    const uint64_t quotient = delta / metadata_->time_mult;
+    const uint64_t remainder = delta % metadata_->time_mult;
+    return ( quotient << metadata_->time_shift )
+           + ( ( remainder << metadata_->time_shift ) / metadata_->time_mult );
+  }
+
+public:
+  explicit PerfSampler( uint64_t sample_period )
+    : page_size_( getpagesize() ), mapping_size_( page_size_ * ( 1 + ring_pages ) )
+  {
+    perf_event_attr attr {};
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.sample_period = sample_period;
+    attr.sample_type = PERF_SAMPLE_TIME | PERF_SAMPLE_READ;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    leader_fd_ = perf_event_open( attr, -1 );
+
+    perf_event_attr cycles_attr {};
+    cycles_attr.size = sizeof( cycles_attr );
+    cycles_attr.type = PERF_TYPE_HARDWARE;
+    cycles_attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    cycles_attr.exclude_kernel = 1;
+    cycles_attr.exclude_hv = 1;
+    cycles_fd_ = perf_event_open( cycles_attr, leader_fd_ );
+
+    void* mapping = mmap( nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, leader_fd_, 0 );
+    if ( mapping == MAP_FAILED ) {
+      throw tagged_error( std::system_category(), "mmap perf ring buffer", errno );
+    }
+    metadata_ = static_cast<perf_event_mmap_page*>( mapping );
+  }
+
+  ~PerfSampler()
+  {
+    munmap( metadata_, mapping_size_ );
+    close( cycles_fd_ );
+    close( leader_fd_ );
+  }
+
+  PerfSampler( const PerfSampler& ) = delete;
+  PerfSampler& operator=( const PerfSampler& ) = delete;
+
+  void start() { CheckSystemCall( "PERF_EVENT_IOC_ENABLE", ioctl( leader_fd_, PERF_EVENT_IOC_ENABLE, 0 ) ); }
+  void stop() { CheckSystemCall( "PERF_EVENT_IOC_DISABLE", ioctl( leader_fd_, PERF_EVENT_IOC_DISABLE, 0 ) ); }
+
+  // copy every record written so far out of the ring buffer (call after stop(), or often enough to keep up)
+  void drain()
+  {
+    // (the conversion parameters are published once the event has been scheduled)
+    if ( !metadata_->cap_user_time_zero ) {
+      throw std::runtime_error( "kernel does not expose the TSC conversion for perf timestamps" );
+    }
+
+    const char* data = reinterpret_cast<const char*>( metadata_ ) + page_size_;
+    const uint64_t data_size = page_size_ * ring_pages;
+    const uint64_t head = std::atomic_ref( metadata_->data_head ).load( std::memory_order_acquire );
+    uint64_t tail = metadata_->data_tail;
+
+    // copy one record field out of the ring, which may wrap around in the middle of a record
+    auto copy_out = [&]( uint64_t offset, void* dest, size_t len ) {
+      for ( size_t i = 0; i < len; ++i ) {
+        static_cast<char*>( dest )[i] = data[( offset + i ) % data_size];
+      }
+    };
+
+    while ( tail < head ) {
+      perf_event_header header;
+      copy_out( tail, &header, sizeof( header ) );
+
+      if ( header.type == PERF_RECORD_SAMPLE ) {
+        // layout for PERF_SAMPLE_TIME | PERF_SAMPLE_READ with PERF_FORMAT_GROUP: time, nr, value[nr]
+        uint64_t fields[4];
+        copy_out( tail + sizeof( header ), fields, sizeof( fields ) );
+        if ( fields[1] != 2 ) {
+          throw std::runtime_error( "unexpected number of counters in perf sample" );
+        }
+        samples_.push_back( { perf_time_to_tsc( fields[0] ), fields[2], fields[3] } );
+      } else if ( header.type == PERF_RECORD_LOST ) {
+        uint64_t fields[2]; // id, lost
+        copy_out( tail + sizeof( header ), fields, sizeof( fields ) );
+        lost_records_ += fields[1];
+      }
+
+      tail += header.size;
+    }
+
+    std::atomic_ref( metadata_->data_tail ).store( tail, std::memory_order_release );
+  }
+
+  const std::vector<Sample>& samples() const { return samples_; }
+  uint64_t lost_records() const { return lost_records_; }
+};
+
+// A user-space cycle counter: reads the hardware counter behind a perf event directly with rdpmc
+// (no system call), using the mmap'd control page to find which counter the event is on.
+class CycleCounter
+{
+  int fd_ {};
+  size_t page_size_;
+  perf_event_mmap_page* metadata_ { nullptr };
+  uint64_t fallback_reads_ {};
+
+public:
+  CycleCounter()
+    : page_size_( getpagesize() )
+  {
+    perf_event_attr attr {};
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = perf_event_open( attr, -1 );
+
+    void* mapping = mmap( nullptr, page_size_, PROT_READ, MAP_SHARED, fd_, 0 );
+    if ( mapping == MAP_FAILED ) {
+      throw tagged_error( std::system_category(), "mmap perf control page", errno );
+    }
+    metadata_ = static_cast<perf_event_mmap_page*>( mapping );
+  }
+
+  ~CycleCounter()
+  {
+    munmap( metadata_, page_size_ );
+    close( fd_ );
+  }
+
+  CycleCounter( const CycleCounter& ) = delete;
+  CycleCounter& operator=( const CycleCounter& ) = delete;
+
+  // the kernel's recommended sequence (see perf_event_mmap_page in linux/perf_event.h),
+  // fenced like read_tsc_lfence() so the reading is ordered with the code around it
+  uint64_t read()
+  {
+    _mm_lfence();
+    uint32_t seq;
+    uint64_t count;
+    do {
+      seq = std::atomic_ref( metadata_->lock ).load( std::memory_order_acquire );
+      const uint32_t index = metadata_->index;
+      if ( !metadata_->cap_user_rdpmc || index == 0 ) {
+        // rdpmc not allowed, or the event is descheduled (e.g. multiplexed) right now: ask the kernel
+        uint64_t value;
+        if ( sizeof( value ) != CheckSystemCall( "read perf counter", ::read( fd_, &value, sizeof( value ) ) ) ) {
+          throw std::runtime_error( "short read from perf counter" );
+        }
+        ++fallback_reads_;
+        _mm_lfence();
+        return value;
+      }
+      const uint32_t width = metadata_->pmc_width;
+      const int64_t raw = int64_t( uint64_t( __rdpmc( index - 1 ) ) << ( 64 - width ) ) >> ( 64 - width );
+      count = metadata_->offset + raw;
+    } while ( std::atomic_ref( metadata_->lock ).load( std::memory_order_acquire ) != seq );
+    _mm_lfence();
+    return count;
+  }
+
+  // readings that had to go through read() instead of rdpmc
+  uint64_t fallback_reads() const { return fallback_reads_; }
+};
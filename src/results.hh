@@ -0,0 +1,124 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "support.hh"
+
+/*
+  One line of the append-only results file, made of tab-separated key=value fields:
+
+    experiment=ipcfun2  time=...  host.name=...  host.kernel_release=...  host.cpu_model=...
+    config.interval=...  calibration.cycles_per_tsc_tick=...  max.average_user_ipc=...
+
+  Keys beginning with "config." identify the experiment's configuration, and keys beginning with
+  "max." or "min." are summary statistics where higher (resp. lower) is better. Records with the same
+  experiment and configuration are compared across hosts or kernels by ipccompare.
+
+  Nothing is written unless the IPCFUN_RESULTS environment variable names the results file.
+*/
+class ResultsRecord
+{
+  std::vector<std::pair<std::string, std::string>> fields_ {};
+
+  static std::string sanitize( std::string value )
+  {
+    for ( auto& ch : value ) {
+      if ( ch == '\t' || ch == '\n' ) {
+        ch = ' ';
+      }
+    }
+    return value;
+  }
+
+  static std::string cpuinfo_field( std::string_view name )
+  {
+    std::ifstream cpuinfo { "/proc/cpuinfo" };
+    std::string line;
+    while ( std::getline( cpuinfo, line ) ) {
+      if ( line.starts_with( name ) ) {
+        const auto colon = line.find( ':' );
+        if ( colon != std::string::npos && colon + 2 <= line.size() ) {
+          return line.substr( colon + 2 );
+        }
+      }
+    }
+    return "unknown";
+  }
+
+  void add_field( std::string key, const auto& value )
+  {
+    std::ostringstream formatted;
+    formatted << std::setprecision( std::numeric_limits<double>::max_digits10 ) << value; // round-trips doubles
+    fields_.emplace_back( std::move( key ), sanitize( formatted.str() ) );
+  }
+
+public:
+  explicit ResultsRecord( std::string_view experiment )
+  {
+    add_field( "experiment", experiment );
+    add_field( "time",
+               std::chrono::duration_cast<std::chrono::seconds>(
+                 std::chrono::system_clock::now().time_since_epoch() )
+                 .count() );
+
+    utsname host {};
+    CheckSystemCall( "uname", uname( &host ) );
+    add_field( "host.name", host.nodename );
+    add_field( "host.kernel_release", host.release );
+    add_field( "host.kernel_version", host.version );
+    add_field( "host.cpu_model", cpuinfo_field( "model name" ) );
+    add_field( "host.cpu_microcode", cpuinfo_field( "microcode" ) );
+  }
+
+  void add_config( std::string_view key, const auto& value ) { add_field( "config." + std::string( key ), value ); }
+
+  void add_calibration( std::string_view key, const auto& value )
+  {
+    add_field( "calibration." + std::string( key ), value );
+  }
+
+  void add_higher_is_better( std::string_view key, const auto& value )
+  {
+    add_field( "max." + std::string( key ), value );
+  }
+
+  void add_lower_is_better( std::string_view key, const auto& value )
+  {
+    add_field( "min." + std::string( key ), value );
+  }
+
+  // append the record as a single write, so concurrent runs cannot interleave their lines
+  void append_to_results_file() const
+  {
+    const char* filename = getenv( "IPCFUN_RESULTS" );
+    if ( !filename ) {
+      return;
+    }
+
+    std::string line;
+    for ( const auto& [key, value] : fields_ ) {
+      line += ( line.empty() ? "" : "\t" ) + key + "=" + value;
+    }
+    line += "\n";
+
+    const int fd = CheckSystemCall( "open", open( filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 ) );
+    const auto written = write( fd, line.data(), line.size() );
+    close( fd );
+    if ( written != ssize_t( line.size() ) ) {
+      throw std::runtime_error( std::string( "could not append results to " ) + filename );
+    }
+  }
+};
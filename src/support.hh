@@ -1,11 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
 #include <charconv>
+#include <chrono>
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
 #include <papi.h>
 #include <sched.h>
+#include <span>
 #include <string>
 #include <system_error>
+#include <thread>
+#include <vector>
 #include <x86intrin.h>
 
 inline const char* str_or_null( const char* x )
@@ -13,30 +22,46 @@ inline const char* str_or_null( const char* x )
   return x ? x : "(null)";
 }
 
-class IPCCounter
+inline int CheckPAPICall( const char* attempt, int ret )
 {
-  int event_set_;
-
-  static inline int CheckPAPICall( const char* attempt, int ret )
-  {
-    if ( ret != PAPI_OK ) {
-      throw std::runtime_error( std::string( attempt ) + ": " + str_or_null( PAPI_strerror( ret ) ) );
-    }
-    return ret;
+  if ( ret != PAPI_OK ) {
+    throw std::runtime_error( std::string( attempt ) + ": " + str_or_null( PAPI_strerror( ret ) ) );
   }
+  return ret;
+}
 
-public:
-  IPCCounter() : event_set_( PAPI_NULL )
+// A PAPI event set of user-level counters, read together in the order they were added
+class PAPICounters
+{
+  int event_set_;
+  std::vector<long long> final_values_;
+
+protected:
+  explicit PAPICounters( std::initializer_list<int> events )
+    : event_set_( PAPI_NULL ), final_values_( events.size() )
   {
     const int version_or_err = PAPI_library_init( PAPI_VER_CURRENT );
     if ( version_or_err != PAPI_VER_CURRENT ) {
       CheckPAPICall( "PAPI_library_init", version_or_err );
     }
     CheckPAPICall( "PAPI_create_eventset", PAPI_create_eventset( &event_set_ ) );
-    CheckPAPICall( "PAPI_add_event", PAPI_add_event( event_set_, PAPI_TOT_INS ) );
-    CheckPAPICall( "PAPI_add_event", PAPI_add_event( event_set_, PAPI_TOT_CYC ) );
+    for ( const int event : events ) {
+      CheckPAPICall( "PAPI_add_event", PAPI_add_event( event_set_, event ) );
+    }
   }
 
+  void read_into( long long* values ) { CheckPAPICall( "PAPI_read", PAPI_read( event_set_, values ) ); }
+
+public:
+  void start() { CheckPAPICall( "PAPI_start", PAPI_start( event_set_ ) ); }
+  void stop() { CheckPAPICall( "PAPI_stop", PAPI_stop( event_set_, final_values_.data() ) ); }
+};
+
+class IPCCounter : public PAPICounters
+{
+public:
+  IPCCounter() : PAPICounters( { PAPI_TOT_INS, PAPI_TOT_CYC } ) {}
+
   struct Reading
   {
     long long instructions;
@@ -46,11 +71,29 @@ public:
   Reading read()
   {
     Reading ret;
-    CheckPAPICall( "PAPI_read", PAPI_read( event_set_, &ret.instructions ) );
+    read_into( &ret.instructions );
     return ret;
   }
+};
 
-  void start() { CheckPAPICall( "PAPI_start", PAPI_start( event_set_ ) ); }
+class BranchCounter : public PAPICounters
+{
+public:
+  BranchCounter() : PAPICounters( { PAPI_TOT_INS, PAPI_TOT_CYC, PAPI_BR_MSP } ) {}
+
+  struct Reading
+  {
+    long long instructions;
+    long long cycles;
+    long long mispredictions;
+  };
+
+  Reading read()
+  {
+    Reading ret;
+    read_into( &ret.instructions );
+    return ret;
+  }
 };
 
 class tagged_error : public std::system_error
@@ -79,12 +122,17 @@ inline int CheckSystemCall( const char* attempt, int ret )
   return ret;
 }
 
-inline void lock_to_CPU_zero()
+inline void lock_to_CPU( int cpu )
 {
   cpu_set_t set;
   CPU_ZERO( &set );
-  CPU_SET( 0, &set );
-  CheckSystemCall( "sched_setaffinity", sched_setaffinity( getpid(), sizeof( set ), &set ) );
+  CPU_SET( cpu, &set );
+  CheckSystemCall( "sched_setaffinity", sched_setaffinity( 0, sizeof( set ), &set ) );
+}
+
+inline void lock_to_CPU_zero()
+{
+  lock_to_CPU( 0 );
 }
 
 inline uint64_t to_uint64( std::string_view str )
@@ -99,6 +147,104 @@ inline uint64_t to_uint64( std::string_view str )
   return ret;
 }
 
+// read the first line of a sysfs file
+inline std::string read_sysfs_line( const std::filesystem::path& path )
+{
+  std::ifstream file { path };
+  std::string line;
+  if ( !std::getline( file, line ) ) {
+    throw std::runtime_error( "could not read " + path.string() );
+  }
+  return line;
+}
+
+// CPUs named by a sysfs CPU list, e.g. "0-3,8-11"
+inline std::vector<int> read_cpu_list( const std::filesystem::path& path )
+{
+  const std::string list = read_sysfs_line( path );
+  std::vector<int> cpus;
+  std::string_view rest = list;
+  while ( !rest.empty() ) {
+    const auto comma = rest.find( ',' );
+    const auto range = rest.substr( 0, comma );
+    rest = comma == std::string_view::npos ? std::string_view {} : rest.substr( comma + 1 );
+
+    const auto dash = range.find( '-' );
+    const auto first = to_uint64( range.substr( 0, dash ) );
+    const auto last = dash == std::string_view::npos ? first : to_uint64( range.substr( dash + 1 ) );
+    for ( auto cpu = first; cpu <= last; ++cpu ) {
+      cpus.push_back( int( cpu ) );
+    }
+  }
+  return cpus;
+}
+
+// CPU topology, from /sys/devices/system/{cpu,node}
+inline std::vector<int> online_CPUs()
+{
+  return read_cpu_list( "/sys/devices/system/cpu/online" );
+}
+
+inline std::filesystem::path CPU_sysfs_directory( int cpu )
+{
+  return "/sys/devices/system/cpu/cpu" + std::to_string( cpu );
+}
+
+// hardware threads sharing a core with `cpu` (including itself)
+inline std::vector<int> SMT_siblings( int cpu )
+{
+  return read_cpu_list( CPU_sysfs_directory( cpu ) / "topology/thread_siblings_list" );
+}
+
+// CPUs sharing the last-level cache with `cpu` (including itself)
+inline std::vector<int> LLC_siblings( int cpu )
+{
+  std::filesystem::path last_level_cache;
+  uint64_t highest_level = 0;
+  for ( const auto& entry : std::filesystem::directory_iterator( CPU_sysfs_directory( cpu ) / "cache" ) ) {
+    if ( !entry.path().filename().string().starts_with( "index" ) ) {
+      continue;
+    }
+    const auto level = to_uint64( read_sysfs_line( entry.path() / "level" ) );
+    if ( level > highest_level ) {
+      highest_level = level;
+      last_level_cache = entry.path();
+    }
+  }
+
+  if ( last_level_cache.empty() ) {
+    return SMT_siblings( cpu );
+  }
+  return read_cpu_list( last_level_cache / "shared_cpu_list" );
+}
+
+// NUMA node containing `cpu` (0 on systems without NUMA information)
+inline int NUMA_node( int cpu )
+{
+  const std::filesystem::path nodes = "/sys/devices/system/node";
+  if ( !std::filesystem::exists( nodes ) ) {
+    return 0;
+  }
+  for ( const auto& entry : std::filesystem::directory_iterator( nodes ) ) {
+    const std::string name = entry.path().filename().string();
+    if ( name.starts_with( "node" ) && name.size() > 4 && isdigit( name.at( 4 ) ) ) {
+      const auto cpus = read_cpu_list( entry.path() / "cpulist" );
+      if ( std::ranges::find( cpus, cpu ) != cpus.end() ) {
+        return int( to_uint64( std::string_view( name ).substr( 4 ) ) );
+      }
+    }
+  }
+  return 0;
+}
+
+// issue a software prefetch for each address in a workload's hot set
+inline void prefetch_hot_set( std::span<const void* const> hot_set )
+{
+  for ( const void* address : hot_set ) {
+    _mm_prefetch( static_cast<const char*>( address ), _MM_HINT_T0 );
+  }
+}
+
 inline uint64_t read_tsc()
 {
   // seems to be Intel's recommended sequence of fences (https://www.felixcloutier.com/x86/rdtsc)
@@ -108,3 +254,50 @@ inline uint64_t read_tsc()
   _mm_lfence();
   return ret;
 }
+
+// cheaper variants: lfence alone orders rdtsc after earlier instructions (but not after earlier stores)
+inline uint64_t read_tsc_lfence()
+{
+  _mm_lfence();
+  uint64_t ret = __rdtsc();
+  _mm_lfence();
+  return ret;
+}
+
+// rdtscp waits for earlier instructions itself; the lfence keeps later ones from starting early
+inline uint64_t read_tscp()
+{
+  unsigned int aux;
+  uint64_t ret = __rdtscp( &aux );
+  _mm_lfence();
+  return ret;
+}
+
+// Smallest difference between two back-to-back readings of a timer: the cost of the measurement
+// itself, to be subtracted from each timed interval
+template<class ReadTime>
+uint64_t measure_timer_floor( const ReadTime& read_time, size_t trials = 100000 )
+{
+  uint64_t floor = UINT64_MAX;
+  for ( size_t i = 0; i < trials; ++i ) {
+    const uint64_t beginning = read_time();
+    const uint64_t ending = read_time();
+    floor = std::min( floor, ending - beginning );
+  }
+  return floor;
+}
+
+// estimate the TSC frequency by comparing it against the monotonic clock over a short interval
+inline double estimate_tsc_ticks_per_second()
+{
+  const auto clock_beginning = std::chrono::steady_clock::now();
+  const auto tsc_beginning = read_tsc();
+
+  std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+
+  const auto tsc_ending = read_tsc();
+  const auto clock_ending = std::chrono::steady_clock::now();
+
+  const std::chrono::duration<double> elapsed = clock_ending - clock_beginning;
+  return double( tsc_ending - tsc_beginning ) / elapsed.count();
+}